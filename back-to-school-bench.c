@@ -0,0 +1,392 @@
+// Microbenchmark for the generation and detection kernels of back-to-school.c
+// The fillNextLine kernel uses the scalar engine; fillWindow and fillSparse
+// time fillNextLine with the other engines.
+//
+// Compile with optimizations, e.g.:
+//   gcc -O2 back-to-school-bench.c -o back-to-school-bench
+//
+// The kernels are timed on synthetic random rows over a range of row widths
+// and fill densities. Results are reported as nanoseconds per cell and
+// nanoseconds per round (one call of the kernel).
+
+#define BACK_TO_SCHOOL_NO_MAIN
+#include "back-to-school.c"
+#include <sched.h>
+
+// Widest row the benchmark generates
+#define BENCH_MAX_WIDTH 10000000
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Number of cells a single sample should roughly cover. Narrow rows are
+// repeated until the sample covers this many cells, so that the timer
+// resolution does not dominate the result.
+#define BENCH_CELLS_PER_SAMPLE (1 << 22)
+
+// Upper limit for the number of rows kept in a game history at once. Very
+// wide rows use fewer rounds so the history fits comfortably in memory.
+#define BENCH_MAX_HISTORY_CELLS 200000000L
+
+#define BENCH_MAX_SAMPLES 1000
+
+typedef struct BenchCase {
+    // Row in the internal representation (' ' and FILLED), padded with
+    // padTrimLine
+    char* row;
+    // Number of squares on the generated row (before padding)
+    int width;
+    double density;
+} BenchCase;
+
+typedef struct BenchSample {
+    // Elapsed time of the timed section
+    double ns;
+    // Number of cells processed in the timed section
+    double cells;
+    // Number of kernel calls (rounds) in the timed section
+    double rounds;
+} BenchSample;
+
+typedef void (*BenchKernel)(BenchCase* c, BenchSample* sample);
+
+typedef struct BenchKernelEntry {
+    const char* name;
+    BenchKernel run;
+} BenchKernelEntry;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t RNG_STATE = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t nextRandom(void) {
+    // xorshift64*: fast and good enough for generating test rows
+    RNG_STATE ^= RNG_STATE >> 12;
+    RNG_STATE ^= RNG_STATE << 25;
+    RNG_STATE ^= RNG_STATE >> 27;
+    return RNG_STATE * 0x2545F4914F6CDD1DULL;
+}
+
+static int roundsFor(int width) {
+    // Number of rounds to fill per game so that the history stays within
+    // BENCH_MAX_HISTORY_CELLS
+    long rounds = BENCH_MAX_HISTORY_CELLS / (2L * width);
+    if(rounds > MAX_ROUNDS - 1) {
+        rounds = MAX_ROUNDS - 1;
+    }
+    return rounds < 1 ? 1 : rounds;
+}
+
+static int repeatsFor(int width) {
+    // Number of kernel calls per sample for the single call kernels
+    int repeats = BENCH_CELLS_PER_SAMPLE / width;
+    return repeats < 1 ? 1 : repeats;
+}
+
+static char* randomRow(int width, double density) {
+    // Generate a random row with the given number of squares, each square
+    // filled with the given probability. The first and last squares are
+    // always filled so the row really is width squares wide.
+    char* row = malloc(width + 1);
+    if(row == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    uint64_t threshold = density >= 1 ? UINT64_MAX :
+        (uint64_t)(density * (double)UINT64_MAX);
+    for(int i = 0; i < width; i++) {
+        row[i] = nextRandom() < threshold ? FILLED : ' ';
+    }
+    row[0] = FILLED;
+    row[width-1] = FILLED;
+    row[width] = '\0';
+    char* padded = padTrimLine(row);
+    free(row);
+    return padded;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static GameState* newBenchGame(BenchCase* c) {
+    // newGameState takes the ownership of the first line
+    char* first = strdup(c->row);
+    if(first == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    return newGameState(first);
+}
+
+static void benchFill(BenchCase* c, BenchSample* sample, EngineId engine) {
+    // Time fillNextLine with the given engine over a full game. Pattern
+    // detection is not run, so every game fills the same number of rounds.
+    int rounds = roundsFor(c->width);
+    int games = repeatsFor(c->width) / rounds;
+    if(games < 1) {
+        games = 1;
+    }
+    for(int g = 0; g < games; g++) {
+        GameState* game = newBenchGame(c);
+        game->engine = engine;
+        double cells = 0;
+        double start = nowNs();
+        for(int r = 0; r < rounds; r++) {
+            fillNextLine(game);
+        }
+        sample->ns += nowNs() - start;
+        for(StackEntry* e = game->linesHead->next; e != NULL; e = e->next) {
+            cells += e->dataStrlen;
+        }
+        sample->cells += cells;
+        sample->rounds += rounds;
+        deallocateGameState(game);
+    }
+}
+
+static void benchFillNextLine(BenchCase* c, BenchSample* sample) {
+    benchFill(c, sample, ENGINE_SCALAR);
+}
+
+static void benchFillWindow(BenchCase* c, BenchSample* sample) {
+    benchFill(c, sample, ENGINE_WINDOW);
+}
+
+static void benchFillSparse(BenchCase* c, BenchSample* sample) {
+    benchFill(c, sample, ENGINE_SPARSE);
+}
+
+static void benchPadTrimLine(BenchCase* c, BenchSample* sample) {
+    int repeats = repeatsFor(c->width);
+    double start = nowNs();
+    for(int i = 0; i < repeats; i++) {
+        char* line = padTrimLine(c->row);
+        free(line);
+    }
+    sample->ns += nowNs() - start;
+    sample->cells += (double)repeats * strlen(c->row);
+    sample->rounds += repeats;
+}
+
+static void benchPush(BenchCase* c, BenchSample* sample) {
+    // push does not copy the line data, but strips it into a new buffer.
+    // Freeing the entry is included in the timing.
+    int repeats = repeatsFor(c->width);
+    double start = nowNs();
+    for(int i = 0; i < repeats; i++) {
+        StackEntry* entry = push(NULL, c->row);
+        free(entry->dataStripped);
+        free(entry);
+    }
+    sample->ns += nowNs() - start;
+    sample->cells += (double)repeats * strlen(c->row);
+    sample->rounds += repeats;
+}
+
+static void benchDetectPattern(BenchCase* c, BenchSample* sample) {
+    // Time the detection on a game with a full history. Rows that are
+    // recognized early are timed with their history at the time of the
+    // detection, just like in play().
+    GameState* game = newBenchGame(c);
+    int rounds = roundsFor(c->width);
+    for(int r = 0; r < rounds; r++) {
+        fillNextLine(game);
+        if(detectPattern(game) != PATTERN_NONE) {
+            break;
+        }
+    }
+    int repeats = repeatsFor(c->width);
+    volatile Pattern sink = PATTERN_NONE;
+    double start = nowNs();
+    for(int i = 0; i < repeats; i++) {
+        sink = detectPattern(game);
+    }
+    sample->ns += nowNs() - start;
+    (void)sink;
+    sample->cells += (double)repeats * game->linesHead->dataStrlen;
+    sample->rounds += repeats;
+    deallocateGameState(game);
+}
+
+static BenchKernelEntry KERNELS[] = {
+    {"fillNextLine", benchFillNextLine},
+    {"fillWindow", benchFillWindow},
+    {"fillSparse", benchFillSparse},
+    {"padTrimLine", benchPadTrimLine},
+    {"push", benchPush},
+    {"detectPattern", benchDetectPattern},
+};
+
+#define NUM_KERNELS ((int)(sizeof(KERNELS) / sizeof(KERNELS[0])))
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int compareDouble(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void runBenchmark(BenchKernelEntry* kernel, BenchCase* c,
+                         int warmup, int reps) {
+    static double nsPerCell[BENCH_MAX_SAMPLES];
+    static double nsPerRound[BENCH_MAX_SAMPLES];
+    for(int i = 0; i < warmup; i++) {
+        BenchSample sample = {0};
+        kernel->run(c, &sample);
+    }
+    for(int i = 0; i < reps; i++) {
+        BenchSample sample = {0};
+        kernel->run(c, &sample);
+        nsPerCell[i] = sample.ns / sample.cells;
+        nsPerRound[i] = sample.ns / sample.rounds;
+    }
+    qsort(nsPerCell, reps, sizeof(double), compareDouble);
+    qsort(nsPerRound, reps, sizeof(double), compareDouble);
+    printf("%-14s %9d %8.3f %5d %12.3f %12.3f %14.1f %14.1f\n",
+        kernel->name, c->width, c->density, reps,
+        nsPerCell[0], nsPerCell[reps/2], nsPerRound[0], nsPerRound[reps/2]);
+    fflush(stdout);
+}
+
+static bool pinToCpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+static void usage(const char* name) {
+    printf("Usage: %s [options]\n"
+        "  --kernel NAME     run only the given kernel (can be repeated)\n"
+        "  --min-width N     smallest row width (default 8)\n"
+        "  --max-width N     largest row width (default %d)\n"
+        "  --density D       fill density in (0,1] (can be repeated,\n"
+        "                    default 0.25, 0.5 and 0.75)\n"
+        "  --warmup N        untimed warmup runs per case (default 2)\n"
+        "  --reps N          timed repetitions per case (default 7)\n"
+        "  --cpu N           pin to the given CPU, -1 disables pinning\n"
+        "                    (default: the CPU the benchmark starts on)\n"
+        "  --seed N          seed for the random rows\n",
+        name, BENCH_MAX_WIDTH);
+}
+
+int main(int argc, char *argv[]) {
+    int minWidth = 8;
+    int maxWidth = BENCH_MAX_WIDTH;
+    double densities[16];
+    int numDensities = 0;
+    bool selected[NUM_KERNELS];
+    bool anySelected = false;
+    int warmup = 2;
+    int reps = 7;
+    int cpu = sched_getcpu();
+
+    memset(selected, 0, sizeof(selected));
+    for(int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i+1] : NULL;
+        if(strcmp(arg, "--help") == 0 || value == NULL) {
+            usage(argv[0]);
+            return strcmp(arg, "--help") == 0 ? 0 : 1;
+        }
+        i++;
+        if(strcmp(arg, "--kernel") == 0) {
+            int k;
+            for(k = 0; k < NUM_KERNELS; k++) {
+                if(strcmp(KERNELS[k].name, value) == 0) {
+                    selected[k] = true;
+                    anySelected = true;
+                    break;
+                }
+            }
+            if(k == NUM_KERNELS) {
+                fprintf(stderr, "ERROR: unknown kernel: \"%s\"\n", value);
+                return 1;
+            }
+        }
+        else if(strcmp(arg, "--min-width") == 0) {
+            minWidth = atoi(value);
+        }
+        else if(strcmp(arg, "--max-width") == 0) {
+            maxWidth = atoi(value);
+        }
+        else if(strcmp(arg, "--density") == 0 && numDensities < 16) {
+            densities[numDensities++] = atof(value);
+        }
+        else if(strcmp(arg, "--warmup") == 0) {
+            warmup = atoi(value);
+        }
+        else if(strcmp(arg, "--reps") == 0) {
+            reps = atoi(value);
+        }
+        else if(strcmp(arg, "--cpu") == 0) {
+            cpu = atoi(value);
+        }
+        else if(strcmp(arg, "--seed") == 0) {
+            RNG_STATE = strtoull(value, NULL, 0) | 1;
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(minWidth < 1 || maxWidth > BENCH_MAX_WIDTH || minWidth > maxWidth) {
+        fprintf(stderr, "ERROR: row widths must be within 1..%d\n",
+            BENCH_MAX_WIDTH);
+        return 1;
+    }
+    if(reps < 1 || reps > BENCH_MAX_SAMPLES || warmup < 0) {
+        fprintf(stderr, "ERROR: repetitions must be within 1..%d\n",
+            BENCH_MAX_SAMPLES);
+        return 1;
+    }
+    if(numDensities == 0) {
+        densities[numDensities++] = 0.25;
+        densities[numDensities++] = 0.5;
+        densities[numDensities++] = 0.75;
+    }
+    for(int d = 0; d < numDensities; d++) {
+        if(!(densities[d] > 0 && densities[d] <= 1)) {
+            fprintf(stderr, "ERROR: density must be within (0,1]\n");
+            return 1;
+        }
+    }
+    if(cpu >= 0) {
+        if(pinToCpu(cpu)) {
+            printf("# pinned to cpu %d\n", cpu);
+        }
+        else {
+            fprintf(stderr, "WARNING: failed to pin to cpu %d\n", cpu);
+        }
+    }
+
+    printf("%-14s %9s %8s %5s %12s %12s %14s %14s\n",
+        "# kernel", "width", "density", "reps",
+        "ns/cell:min", "ns/cell:med", "ns/round:min", "ns/round:med");
+    // Widths grow by a factor of 8: 8, 64, 512, ... The largest width is
+    // always included.
+    for(long width = minWidth; ; width *= 8) {
+        if(width > maxWidth) {
+            width = maxWidth;
+        }
+        for(int d = 0; d < numDensities; d++) {
+            BenchCase c = {
+                .row = randomRow(width, densities[d]),
+                .width = width,
+                .density = densities[d],
+            };
+            for(int k = 0; k < NUM_KERNELS; k++) {
+                if(anySelected && !selected[k]) {
+                    continue;
+                }
+                runBenchmark(&KERNELS[k], &c, warmup, reps);
+            }
+            free(c.row);
+        }
+        if(width == maxWidth) {
+            break;
+        }
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
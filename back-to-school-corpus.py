@@ -0,0 +1,186 @@
+"""Deterministic generator for synthetic back-to-school input corpora.
+
+Usage: python back-to-school-corpus.py <kind> [options]
+
+Kinds:
+  short    millions of short lines (the common case)
+  huge     a few lines close to MAX_LINE_LEN
+  longrun  lines that run all MAX_ROUNDS rounds without being recognized
+  dup      heavy duplication: lines drawn from a small pool
+  mixed    realistic mix of all of the above
+
+The same kind, seed and options always produce the same corpus, with both
+Python 2 and Python 3.
+"""
+from __future__ import print_function
+
+import argparse
+import random
+import sys
+
+################################################################################
+
+EMPTY  = '.'
+FILLED = '#'
+MAX_ROUNDS = 100
+
+# Input lines (including the newline) must not be longer than MAX_LINE_LEN,
+# see back-to-school.c
+MAX_LINE_LEN = 1024*10
+
+################################################################################
+
+def nextRow(row):
+    # Apply the rules on a row stored as an integer bitmask. Bit i is square
+    # i of the row. The result is shifted 2 squares to the left, which does
+    # not matter since the rows are compared with normalizeRow.
+    y = row << 2
+    t0, t1, t2, t3, t4 = y << 2, y << 1, y, y >> 1, y >> 2
+    # Bit-sliced sum of the 5 squares of each block: count = c2 c1 c0
+    s0 = t0 ^ t1 ^ t2
+    k0 = (t0 & t1) | (t2 & (t0 ^ t1))
+    c0 = s0 ^ t3 ^ t4
+    k1 = (s0 & t3) | (t4 & (s0 ^ t3))
+    c1 = k0 ^ k1
+    c2 = k0 & k1
+    # Rule #1: blank square with 2 or 3 filled (count 2 or 3)
+    # Rule #2: filled square with 2 or 4 filled next to it (count 3 or 5)
+    return (~t2 & c1 & ~c2) | (t2 & c0 & (c1 ^ c2))
+
+def normalizeRow(row):
+    # Drop the blank squares below the lowest filled square
+    return row >> ((row & -row).bit_length() - 1) if row else 0
+
+def runsAllRounds(line):
+    # True if the line is not recognized as vanishing, blinking or gliding
+    # before MAX_ROUNDS lines have been filled
+    row = 0
+    for i, c in enumerate(line):
+        if c == FILLED:
+            row |= 1 << i
+    seen = set([normalizeRow(row)])
+    for _ in range(MAX_ROUNDS - 1):
+        row = normalizeRow(nextRow(row))
+        if row == 0 or row in seen:
+            return False
+        seen.add(row)
+    return True
+
+################################################################################
+
+class Generator(object):
+    def __init__(self, seed, maxWidth):
+        self.rng = random.Random(seed)
+        self.maxWidth = maxWidth
+
+    def uniform(self, lo, hi):
+        # Random integer in [lo, hi]. Random.randint differs between Python
+        # versions, random() does not.
+        return lo + int(self.rng.random() * (hi - lo + 1))
+
+    def row(self, width, density=0.5):
+        # Random row of the given width with squares filled with roughly the
+        # given density (0.25, 0.5 or 0.75). The first and the last squares
+        # are always filled.
+        bits = self.rng.getrandbits(width)
+        if density < 0.5:
+            bits &= self.rng.getrandbits(width)
+        elif density > 0.5:
+            bits |= self.rng.getrandbits(width)
+        bits |= 1 | (1 << (width - 1))
+        return ''.join(FILLED if (bits >> i) & 1 else EMPTY
+                       for i in range(width))
+
+    def shortLine(self):
+        density = [0.25, 0.5, 0.75][self.uniform(0, 2)]
+        return self.row(self.uniform(1, 40), density)
+
+    def hugeLine(self):
+        return self.row(self.uniform(self.maxWidth // 2, self.maxWidth))
+
+    def longrunLine(self, minWidth=20, maxWidth=200):
+        # Rejection sampling: random rows with density 0.5 run all rounds
+        # often enough
+        while True:
+            width = self.uniform(minWidth, min(maxWidth, self.maxWidth))
+            line = self.row(width)
+            if runsAllRounds(line):
+                return line
+
+    def pool(self, size, make):
+        return [make() for _ in range(size)]
+
+    def pick(self, pool):
+        # Skewed choice: low indices are picked much more often
+        return pool[int(len(pool) * self.rng.random() ** 3)]
+
+################################################################################
+
+def generate(kind, gen, lines):
+    if kind == 'short':
+        for _ in range(lines):
+            yield gen.shortLine()
+    elif kind == 'huge':
+        for _ in range(lines):
+            yield gen.hugeLine()
+    elif kind == 'longrun':
+        for _ in range(lines):
+            yield gen.longrunLine(maxWidth=gen.maxWidth)
+    elif kind == 'dup':
+        pool = gen.pool(64, gen.shortLine) + gen.pool(8, gen.longrunLine)
+        for _ in range(lines):
+            yield gen.pick(pool)
+    elif kind == 'mixed':
+        # Mostly short lines, repeated ones and rare long running and huge
+        # lines
+        pool = gen.pool(256, gen.shortLine)
+        for _ in range(lines):
+            p = gen.rng.random()
+            if p < 0.60:
+                yield gen.shortLine()
+            elif p < 0.90:
+                yield gen.pick(pool)
+            elif p < 0.9995:
+                yield gen.longrunLine()
+            else:
+                yield gen.hugeLine()
+
+KINDS = ['short', 'huge', 'longrun', 'dup', 'mixed']
+
+# Default number of lines for each kind
+DEFAULT_LINES = {
+    'short': 1000000,
+    'huge': 16,
+    'longrun': 10000,
+    'dup': 1000000,
+    'mixed': 100000,
+}
+
+################################################################################
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Generate a synthetic back-to-school input corpus.')
+    parser.add_argument('kind', choices=KINDS)
+    parser.add_argument('--lines', type=int,
+                        help='number of lines (default depends on the kind)')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--max-width', type=int, default=MAX_LINE_LEN - 1,
+                        help='widest line to generate (default %(default)s)')
+    parser.add_argument('-o', '--output', help='output file (default stdout)')
+    args = parser.parse_args()
+
+    if not 1 <= args.max_width < MAX_LINE_LEN:
+        parser.error('--max-width must be within 1..%d' % (MAX_LINE_LEN - 1))
+    lines = args.lines if args.lines is not None else DEFAULT_LINES[args.kind]
+    gen = Generator(args.seed, args.max_width)
+    out = open(args.output, 'w') if args.output else sys.stdout
+    for line in generate(args.kind, gen, lines):
+        out.write(line + '\n')
+    if out is not sys.stdout:
+        out.close()
+
+if __name__ == '__main__':
+    main()
+
+################################################################################
@@ -0,0 +1,427 @@
+// Differential fuzzing harness for the engines of back-to-school.c
+//
+// Random rows are played with every engine in lockstep, and the lines they
+// fill and the patterns they recognize are compared round by round. The
+// results of classifyLine are also compared with back-to-school.py, which is
+// run on batches of rows. A mismatch is minimized to a shortest row that
+// still mismatches before it is reported.
+//
+// Randomized driver, compile e.g. with:
+//   gcc -O1 -g -fsanitize=address,undefined back-to-school-fuzz.c
+//       -o back-to-school-fuzz
+//
+// libFuzzer target (the engines only, back-to-school.py is too slow to run
+// on every input):
+//   clang -O1 -g -fsanitize=fuzzer,address -DLIBFUZZER
+//       back-to-school-fuzz.c -o back-to-school-libfuzzer
+
+#define BACK_TO_SCHOOL_NO_MAIN
+#include "back-to-school.c"
+
+// Rows the randomized driver classifies with back-to-school.py at a time
+#define FUZZ_BATCH_ROWS 2000
+
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct EngineMismatch {
+    // Round in which the engines first disagree, -1 if they agree
+    int round;
+    // The engine that disagrees with the scalar engine
+    EngineId engine;
+    // What disagrees: "line", "population" or "pattern"
+    const char* what;
+} EngineMismatch;
+
+bool compareEngines(char* row, EngineMismatch* mismatch) {
+    // Play the given row (validated, with blanks as whitespaces) with every
+    // engine in lockstep. Return false and describe the first difference
+    // from the scalar engine in mismatch if the engines disagree.
+    GameState* games[ENGINES];
+    for(int e = 0; e < ENGINES; e++) {
+        games[e] = newGameState(padTrimLine(row));
+        games[e]->engine = e;
+    }
+    mismatch->round = -1;
+    bool done = false;
+    while(!done && linesFilled(games[0]) < MAX_ROUNDS) {
+        Pattern patterns[ENGINES];
+        for(int e = 0; e < ENGINES; e++) {
+            fillNextLine(games[e]);
+            patterns[e] = detectPattern(games[e]);
+        }
+        for(int e = 1; e < ENGINES && mismatch->round < 0; e++) {
+            if(strcmp(games[e]->linesHead->data,
+                      games[0]->linesHead->data) != 0) {
+                mismatch->what = "line";
+            }
+            else if(games[e]->population != games[0]->population) {
+                mismatch->what = "population";
+            }
+            else if(patterns[e] != patterns[0]) {
+                mismatch->what = "pattern";
+            }
+            else {
+                continue;
+            }
+            mismatch->round = linesFilled(games[0]) - 1;
+            mismatch->engine = e;
+        }
+        done = mismatch->round >= 0 || patterns[0] != PATTERN_NONE;
+    }
+    for(int e = 0; e < ENGINES; e++) {
+        deallocateGameState(games[e]);
+    }
+    return mismatch->round < 0;
+}
+
+void printRow(FILE* out, char* row) {
+    // Print the row in the input format
+    for(char* c = row; *c != '\0'; c++) {
+        fputc(*c == ' ' ? EMPTY : *c, out);
+    }
+    fputc('\n', out);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    // Every byte is a square, filled if its lowest bit is set
+    if(size == 0 || size >= MAX_LINE_LEN) {
+        return 0;
+    }
+    char* row = malloc(size + 1);
+    if(row == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    for(size_t i = 0; i < size; i++) {
+        row[i] = data[i] & 1 ? FILLED : ' ';
+    }
+    row[size] = '\0';
+    EngineMismatch mismatch;
+    if(!compareEngines(row, &mismatch)) {
+        fprintf(stderr, "MISMATCH: engine %s, %s in round %d:\n",
+            ENGINE_NAMES[mismatch.engine], mismatch.what, mismatch.round);
+        printRow(stderr, row);
+        abort();
+    }
+    free(row);
+    return 0;
+}
+#else
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t RNG_STATE = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t nextRandom(void) {
+    // xorshift64*
+    RNG_STATE ^= RNG_STATE >> 12;
+    RNG_STATE ^= RNG_STATE << 25;
+    RNG_STATE ^= RNG_STATE >> 27;
+    return RNG_STATE * 0x2545F4914F6CDD1DULL;
+}
+
+static int randomBelow(int n) {
+    return nextRandom() % n;
+}
+
+static char* randomRow(int maxWidth) {
+    // Random row, biased towards the cases that matter: narrow rows around
+    // the 3 square padding, runs of blanks on both ends, blank rows, sparse
+    // and dense rows and now and then the widest rows allowed
+    int width;
+    switch(randomBelow(8)) {
+    case 0:
+        width = 1 + randomBelow(8);
+        break;
+    case 1:
+        width = maxWidth - randomBelow(maxWidth < 8 ? maxWidth : 8);
+        break;
+    case 2: case 3:
+        width = 1 + randomBelow(maxWidth < 1000 ? maxWidth : 1000);
+        break;
+    default:
+        width = 1 + randomBelow(maxWidth < 64 ? maxWidth : 64);
+        break;
+    }
+    // Filled squares per 64 squares
+    int density = randomBelow(4) == 0 ? randomBelow(4) : randomBelow(65);
+    char* row = malloc(width + 1);
+    if(row == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    for(int i = 0; i < width; i++) {
+        row[i] = randomBelow(64) < density ? FILLED : ' ';
+    }
+    row[width] = '\0';
+    if(randomBelow(4) == 0) {
+        // Blank run at one end
+        int run = randomBelow(width + 1);
+        memset(randomBelow(2) ? row : row + width - run, ' ', run);
+    }
+    return row;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// back-to-school.py is run with PYTHON, if not NULL
+static char* PYTHON = "python2";
+static char* PYTHON_SCRIPT = "back-to-school.py";
+
+bool runReference(char** rows, int count, Pattern* patterns) {
+    // Classify the given rows with back-to-school.py. Return false if the
+    // script could not be run or its output could not be parsed.
+    char path[] = "/tmp/back-to-school-fuzz-XXXXXX";
+    int fd = mkstemp(path);
+    FILE* fp = fd < 0 ? NULL : fdopen(fd, "w");
+    if(fp == NULL) {
+        fprintf(stderr, "ERROR: failed to create a temporary file\n");
+        exit(1);
+    }
+    for(int i = 0; i < count; i++) {
+        printRow(fp, rows[i]);
+    }
+    fclose(fp);
+    char command[8192];
+    snprintf(command, sizeof(command), "%s %s %s", PYTHON, PYTHON_SCRIPT,
+        path);
+    FILE* out = popen(command, "r");
+    int parsed = 0;
+    if(out != NULL) {
+        char buffer[64];
+        while(parsed < count && fgets(buffer, sizeof(buffer), out) != NULL) {
+            buffer[strcspn(buffer, "\n")] = '\0';
+            int p = PATTERN_VANISHING;
+            while(p <= PATTERN_OTHER && strcmp(buffer, PATTERN_NAMES[p])) {
+                p++;
+            }
+            if(p > PATTERN_OTHER) {
+                break;
+            }
+            patterns[parsed++] = p;
+        }
+        if(pclose(out) != 0) {
+            parsed = -1;
+        }
+    }
+    remove(path);
+    return parsed == count;
+}
+
+Pattern classifyRow(char* row) {
+    // Pattern of the row on the production path of back-to-school.c
+    LineResult result = {0};
+    classifyLine(row, &result);
+    return result.pattern;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int shrinkCandidates(char* row, char** candidates) {
+    // Rows one step smaller than the given row: with one square removed, or
+    // with one filled square cleared. Return the number of candidates.
+    int width = strlen(row);
+    int count = 0;
+    for(int i = 0; i < width && width > 1; i++) {
+        char* c = malloc(width);
+        if(c == NULL) {
+            printf("ERROR: memory allocation failed\n");
+            exit(1);
+        }
+        memcpy(c, row, i);
+        memcpy(c + i, row + i + 1, width - i);
+        candidates[count++] = c;
+    }
+    for(int i = 0; i < width; i++) {
+        if(row[i] == FILLED) {
+            char* c = strdup(row);
+            if(c == NULL) {
+                printf("ERROR: memory allocation failed\n");
+                exit(1);
+            }
+            c[i] = ' ';
+            candidates[count++] = c;
+        }
+    }
+    return count;
+}
+
+char* minimizeEngines(char* row) {
+    // Shrink a row the engines disagree on while they still disagree
+    char** candidates = malloc(2 * (strlen(row) + 1) * sizeof(char*));
+    if(candidates == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    row = strdup(row);
+    bool shrunk = true;
+    while(shrunk) {
+        shrunk = false;
+        int count = shrinkCandidates(row, candidates);
+        for(int i = 0; i < count; i++) {
+            EngineMismatch mismatch;
+            if(!shrunk && !compareEngines(candidates[i], &mismatch)) {
+                free(row);
+                row = candidates[i];
+                shrunk = true;
+            }
+            else {
+                free(candidates[i]);
+            }
+        }
+    }
+    free(candidates);
+    return row;
+}
+
+char* minimizeReference(char* row) {
+    // Shrink a row back-to-school.py and back-to-school.c disagree on while
+    // they still disagree. All the candidates of a step are classified with
+    // a single run of back-to-school.py.
+    char** candidates = malloc(2 * (strlen(row) + 1) * sizeof(char*));
+    Pattern* expected = malloc(2 * (strlen(row) + 1) * sizeof(Pattern));
+    if(candidates == NULL || expected == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    row = strdup(row);
+    bool shrunk = true;
+    while(shrunk) {
+        shrunk = false;
+        int count = shrinkCandidates(row, candidates);
+        bool ran = count > 0 && runReference(candidates, count, expected);
+        for(int i = 0; i < count; i++) {
+            if(ran && !shrunk && classifyRow(candidates[i]) != expected[i]) {
+                free(row);
+                row = candidates[i];
+                shrunk = true;
+            }
+            else {
+                free(candidates[i]);
+            }
+        }
+    }
+    free(candidates);
+    free(expected);
+    return row;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void usage(const char* name) {
+    printf("Usage: %s [options]\n"
+        "  --rows N         number of random rows (default 10000)\n"
+        "  --max-width N    widest row (default %d)\n"
+        "  --seed N         seed for the random rows\n"
+        "  --python CMD     Python 2 interpreter for back-to-school.py\n"
+        "                   (default python2)\n"
+        "  --script FILE    path of back-to-school.py\n"
+        "  --no-python      compare the engines only\n",
+        name, MAX_LINE_LEN - 1);
+}
+
+int main(int argc, char *argv[]) {
+    long rows = 10000;
+    int maxWidth = MAX_LINE_LEN - 1;
+    for(int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i+1] : NULL;
+        if(strcmp(arg, "--help") == 0) {
+            usage(argv[0]);
+            return 0;
+        }
+        if(strcmp(arg, "--no-python") == 0) {
+            PYTHON = NULL;
+            continue;
+        }
+        if(value == NULL) {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+        if(strcmp(arg, "--rows") == 0) {
+            rows = atol(value);
+        }
+        else if(strcmp(arg, "--max-width") == 0) {
+            maxWidth = atoi(value);
+        }
+        else if(strcmp(arg, "--seed") == 0) {
+            RNG_STATE = strtoull(value, NULL, 0) | 1;
+        }
+        else if(strcmp(arg, "--python") == 0) {
+            PYTHON = argv[i];
+        }
+        else if(strcmp(arg, "--script") == 0) {
+            PYTHON_SCRIPT = argv[i];
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(maxWidth < 1 || maxWidth >= MAX_LINE_LEN) {
+        fprintf(stderr, "ERROR: row widths must be within 1..%d\n",
+            MAX_LINE_LEN - 1);
+        return 1;
+    }
+
+    char* batch[FUZZ_BATCH_ROWS];
+    Pattern expected[FUZZ_BATCH_ROWS];
+    long mismatches = 0;
+    long done = 0;
+    while(done < rows) {
+        int count = 0;
+        int batchRows = rows - done < FUZZ_BATCH_ROWS ? 
+            rows - done : FUZZ_BATCH_ROWS;
+        for(int r = 0; r < batchRows; r++) {
+            char* row = randomRow(maxWidth);
+            EngineMismatch mismatch;
+            if(!compareEngines(row, &mismatch)) {
+                char* minimal = minimizeEngines(row);
+                compareEngines(minimal, &mismatch);
+                printf("MISMATCH: engine %s, %s in round %d:\n",
+                    ENGINE_NAMES[mismatch.engine], mismatch.what,
+                    mismatch.round);
+                printRow(stdout, minimal);
+                free(minimal);
+                mismatches++;
+            }
+            if(PYTHON != NULL) {
+                batch[count++] = row;
+            }
+            else {
+                free(row);
+            }
+        }
+        if(count > 0 && !runReference(batch, count, expected)) {
+            fprintf(stderr, "ERROR: failed to run \"%s %s\"\n", PYTHON,
+                PYTHON_SCRIPT);
+            return 1;
+        }
+        for(int i = 0; i < count; i++) {
+            Pattern pattern = classifyRow(batch[i]);
+            if(pattern != expected[i]) {
+                char* minimal = minimizeReference(batch[i]);
+                Pattern reference = expected[i];
+                runReference(&minimal, 1, &reference);
+                printf("MISMATCH: %s in C, %s in Python:\n",
+                    PATTERN_NAMES[classifyRow(minimal)],
+                    PATTERN_NAMES[reference]);
+                printRow(stdout, minimal);
+                free(minimal);
+                mismatches++;
+            }
+            free(batch[i]);
+        }
+        done += batchRows;
+        fprintf(stderr, "%ld rows, %ld mismatches\r", done, mismatches);
+    }
+    fprintf(stderr, "\n");
+    return mismatches > 0 ? 1 : 0;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
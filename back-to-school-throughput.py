@@ -0,0 +1,135 @@
+"""End-to-end throughput and latency benchmark for back-to-school.
+
+Usage: python back-to-school-throughput.py [options] <corpus> [<corpus> ...]
+
+For every corpus (see back-to-school-corpus.py) and implementation, the
+whole corpus is classified to measure lines/s and MB/s. Then a sample of the
+lines is fed one at a time through a pipe to a single running process to
+measure the per-line latency percentiles.
+"""
+from __future__ import print_function, division
+
+import argparse
+import os
+import subprocess
+import sys
+import time
+
+################################################################################
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+def readCorpus(path):
+    # Return the non-blank lines of the corpus and the size of the file
+    with open(path, 'rb') as f:
+        data = f.read()
+    lines = [l for l in data.split(b'\n') if l.strip()]
+    return lines, len(data)
+
+def percentile(sortedValues, p):
+    # Nearest-rank percentile
+    if not sortedValues:
+        return float('nan')
+    rank = int(round(p / 100.0 * len(sortedValues) + 0.5)) - 1
+    return sortedValues[max(0, min(rank, len(sortedValues) - 1))]
+
+################################################################################
+
+class Implementation(object):
+    def __init__(self, name, command, streamCommand):
+        self.name = name
+        # Command line for classifying a whole file
+        self.command = command
+        # Command line for classifying lines read from stdin one at a time,
+        # with the output flushed after every line
+        self.streamCommand = streamCommand
+
+    def throughput(self, path, repeat):
+        # Best wall time of classifying the whole file
+        best = None
+        with open(os.devnull, 'wb') as devnull:
+            for _ in range(repeat):
+                start = time.time()
+                subprocess.check_call(self.command + [path], stdout=devnull)
+                elapsed = time.time() - start
+                best = elapsed if best is None else min(best, elapsed)
+        return best
+
+    def latencies(self, lines):
+        # Per-line latencies in seconds, one line in flight at a time
+        proc = subprocess.Popen(self.streamCommand + ['/dev/stdin'],
+                                stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        result = []
+        try:
+            for line in lines:
+                start = time.time()
+                proc.stdin.write(line + b'\n')
+                proc.stdin.flush()
+                answer = proc.stdout.readline()
+                result.append(time.time() - start)
+                if not answer:
+                    raise RuntimeError('%s exited early' % self.name)
+        finally:
+            proc.stdin.close()
+            proc.wait()
+        return result
+
+def implementations(args):
+    result = []
+    for name in args.impl.split(','):
+        if name == 'c':
+            stream = ['stdbuf', '-oL', args.binary]
+            result.append(Implementation('c', [args.binary], stream))
+        elif name == 'python':
+            script = os.path.join(HERE, 'back-to-school.py')
+            result.append(Implementation(
+                'python', [args.python, script], [args.python, '-u', script]))
+        else:
+            sys.exit('ERROR: unknown implementation: "%s"' % name)
+    return result
+
+################################################################################
+
+ROW_FORMAT = '%-24s %-7s %9d %8.2f %9.3f %11.0f %8.2f %9.1f %9.1f %9.1f'
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='End-to-end throughput and latency of back-to-school.')
+    parser.add_argument('corpus', nargs='+')
+    parser.add_argument('--binary',
+                        default=os.path.join(HERE, 'back-to-school'),
+                        help='C binary (default %(default)s)')
+    parser.add_argument('--python', default='python2',
+                        help='Python 2 interpreter for back-to-school.py')
+    parser.add_argument('--impl', default='c,python',
+                        help='comma separated implementations to run '
+                        '(default %(default)s)')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='throughput runs per corpus, best is reported')
+    parser.add_argument('--latency-lines', type=int, default=1000,
+                        help='number of lines sampled for the latency '
+                        'percentiles, 0 disables (default %(default)s)')
+    args = parser.parse_args()
+
+    print('%-24s %-7s %9s %8s %9s %11s %8s %9s %9s %9s' % (
+        '# corpus', 'impl', 'lines', 'MB', 'wall[s]', 'lines/s', 'MB/s',
+        'p50[us]', 'p99[us]', 'p999[us]'))
+    for path in args.corpus:
+        lines, size = readCorpus(path)
+        step = max(1, len(lines) // args.latency_lines) \
+            if args.latency_lines > 0 else 0
+        sample = lines[::step][:args.latency_lines] if step else []
+        for impl in implementations(args):
+            wall = impl.throughput(path, args.repeat)
+            lat = sorted(impl.latencies(sample))
+            print(ROW_FORMAT % (
+                os.path.basename(path), impl.name, len(lines), size / 1e6,
+                wall, len(lines) / wall, size / 1e6 / wall,
+                percentile(lat, 50) * 1e6, percentile(lat, 99) * 1e6,
+                percentile(lat, 99.9) * 1e6))
+            sys.stdout.flush()
+
+if __name__ == '__main__':
+    main()
+
+################################################################################
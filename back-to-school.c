@@ -1,8 +1,24 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -15,13 +31,167 @@
 // value if needed. The upper limit is SSIZE_MAX.
 // On a typical system, the value of SSIZE_MAX is the maximum value of signed 
 // long, which is usually 2^63 (64-bit systems) or 2^31 (32-bit systems).
+// The value can also be given on the compiler command line, e.g.
+// -DMAX_LINE_LEN=10000000.
+#ifndef MAX_LINE_LEN
 #define MAX_LINE_LEN 1024*10
+#endif
 
-// TEMPLINE is used as a temporary buffer for the line strings.
-// Uninitialized globals are allocated outside of stack in the BSS segment. 
-// Therefore, we will not overflow the stack even if the MAX_LINE_LEN is 
-// increased to a value bigger than the stack size.
-static char TEMPLINE[MAX_LINE_LEN];
+// Lines are handed to the worker threads in batches of at most BATCH_LINES
+// lines or BATCH_BYTES characters, whichever limit is reached first.
+#define BATCH_LINES 256
+#define BATCH_BYTES (64*1024)
+
+// Number of batches each worker thread can have in flight. Batches are
+// printed in input order, so this also bounds the reorder window.
+#define BATCHES_PER_WORKER 4
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Counters of the work done in the hot loops. They are compiled in only if
+// HOT_COUNTERS is defined (e.g. gcc -DHOT_COUNTERS ...), otherwise COUNT
+// expands to nothing. Every thread counts into its own thread-local copy,
+// which is added to the totals when the thread is done.
+#ifdef HOT_COUNTERS
+typedef struct HotCounters {
+    // Squares evaluated by fillNextLine
+    uint64_t cells;
+    // Calls to fillNextLine
+    uint64_t rounds;
+    // Line comparisons made by detectPattern
+    uint64_t comparisons;
+    // Bytes copied between line buffers
+    uint64_t bytesCopied;
+    // Heap allocations
+    uint64_t allocations;
+    // Lines recognized from the catalog and rounds composed from the cached
+    // evolutions of the collision search, and the lines and rounds that had
+    // to be played instead
+    uint64_t cacheHits;
+    uint64_t cacheMisses;
+} HotCounters;
+
+static __thread HotCounters HOT;
+static HotCounters HOT_TOTALS;
+static pthread_mutex_t HOT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+#define COUNT(counter, n) (HOT.counter += (n))
+
+void flushHotCounters(void) {
+    // Add the counters of the calling thread to the totals
+    pthread_mutex_lock(&HOT_LOCK);
+    HOT_TOTALS.cells += HOT.cells;
+    HOT_TOTALS.rounds += HOT.rounds;
+    HOT_TOTALS.comparisons += HOT.comparisons;
+    HOT_TOTALS.bytesCopied += HOT.bytesCopied;
+    HOT_TOTALS.allocations += HOT.allocations;
+    HOT_TOTALS.cacheHits += HOT.cacheHits;
+    HOT_TOTALS.cacheMisses += HOT.cacheMisses;
+    memset(&HOT, 0, sizeof(HOT));
+    pthread_mutex_unlock(&HOT_LOCK);
+}
+
+void writeHotCounters(FILE* out) {
+    fprintf(out, "cells evaluated:       %llu\n"
+        "rounds:                %llu\n"
+        "history comparisons:   %llu\n"
+        "bytes copied:          %llu\n"
+        "allocations:           %llu\n"
+        "cache hits:            %llu\n"
+        "cache misses:          %llu\n",
+        (unsigned long long)HOT_TOTALS.cells,
+        (unsigned long long)HOT_TOTALS.rounds,
+        (unsigned long long)HOT_TOTALS.comparisons,
+        (unsigned long long)HOT_TOTALS.bytesCopied,
+        (unsigned long long)HOT_TOTALS.allocations,
+        (unsigned long long)HOT_TOTALS.cacheHits,
+        (unsigned long long)HOT_TOTALS.cacheMisses);
+}
+#else
+#define COUNT(counter, n) ((void)0)
+
+void flushHotCounters(void) {
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Bytes in use are accounted per subsystem. The accounting is done per line
+// buffer or per round rather than per byte, and the counters are shared by
+// all the threads.
+typedef enum MemorySubsystem {
+    // Lines of the games being played
+    MEM_HISTORY = 0,
+    // Scratch and input line buffers
+    MEM_ROW_BUFFERS,
+    // Batches waiting for or in the worker threads
+    MEM_QUEUES,
+    // Cached free evolutions of the collision search objects
+    MEM_CACHES,
+    // Traces, histograms and performance counters
+    MEM_INSTRUMENTATION,
+    MEM_SUBSYSTEMS,
+} MemorySubsystem;
+
+static const char* MEM_SUBSYSTEM_NAMES[MEM_SUBSYSTEMS] = {
+    "history", "row-buffers", "queues", "caches", "instrumentation"
+};
+
+static size_t MEM_CURRENT[MEM_SUBSYSTEMS];
+static size_t MEM_PEAK[MEM_SUBSYSTEMS];
+static size_t MEM_TOTAL;
+static size_t MEM_TOTAL_PEAK;
+
+// Memory budget given with --max-memory, 0 if unlimited
+static size_t MEMORY_BUDGET;
+
+void updatePeak(size_t* peak, size_t value) {
+    size_t old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while(value > old && !__atomic_compare_exchange_n(peak, &old, value,
+              true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void memAdd(MemorySubsystem subsystem, size_t bytes) {
+    size_t current = __atomic_add_fetch(&MEM_CURRENT[subsystem], bytes,
+        __ATOMIC_RELAXED);
+    size_t total = __atomic_add_fetch(&MEM_TOTAL, bytes, __ATOMIC_RELAXED);
+    updatePeak(&MEM_PEAK[subsystem], current);
+    updatePeak(&MEM_TOTAL_PEAK, total);
+}
+
+void memSub(MemorySubsystem subsystem, size_t bytes) {
+    __atomic_sub_fetch(&MEM_CURRENT[subsystem], bytes, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&MEM_TOTAL, bytes, __ATOMIC_RELAXED);
+}
+
+size_t memCurrent(MemorySubsystem subsystem) {
+    return __atomic_load_n(&MEM_CURRENT[subsystem], __ATOMIC_RELAXED);
+}
+
+size_t historyEstimate(size_t width) {
+    // Upper estimate of the history bytes of a game on a line of the given
+    // width: every round stores the line and its stripped copy, and the line
+    // grows by at most 2 squares on both ends per round
+    return MAX_ROUNDS * (2 * (width + 2 * MAX_ROUNDS + 8) + 64);
+}
+
+void writeMemoryReport(FILE* out) {
+    fprintf(out, "# %-16s %14s %14s\n", "subsystem", "current", "peak");
+    for(int i = 0; i < MEM_SUBSYSTEMS; i++) {
+        fprintf(out, "%-18s %14zu %14zu\n", MEM_SUBSYSTEM_NAMES[i],
+            MEM_CURRENT[i], MEM_PEAK[i]);
+    }
+    fprintf(out, "%-18s %14zu %14zu\n", "total", MEM_TOTAL, MEM_TOTAL_PEAK);
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0) {
+        fprintf(out, "%-18s %14s %14ld\n", "rss", "",
+            usage.ru_maxrss * 1024L);
+    }
+    if(MEMORY_BUDGET != 0) {
+        fprintf(out, "%-18s %14s %14zu\n", "budget", "", MEMORY_BUDGET);
+    }
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -67,6 +237,10 @@ typedef struct StackEntry {
     int dataStrlen;
     // Line with whitespaces removed from both ends
     char* dataStripped;
+    // Stripped line string length
+    int dataStrippedLen;
+    // Index of the stripped line on the line
+    int dataStrippedIdx;
     // Position of this entry from the bottom of the stack. On the first entry, 
     // (pos+1) equals number of entries pushed on the stack.
     uint8_t pos;
@@ -81,10 +255,23 @@ StackEntry* push(StackEntry* head, char* data) {
     }
     new->data = data;
     new->dataStrlen = strlen(data);
-    // We use TEMPLINE as a temporary buffer for the stripped line
-    memcpy(TEMPLINE, new->data, new->dataStrlen + 1);
-    char* tmp = strip(TEMPLINE);
-    new->dataStripped = strdup(tmp);
+    // Strip whitespaces from both ends of the line into a new buffer.
+    // The line itself is left untouched, so this is safe to call from
+    // several threads at the same time.
+    char* begin = stripLeft(data);
+    char* end = data + new->dataStrlen;
+    while(end > begin && end[-1] == ' ') {
+        end--;
+    }
+    new->dataStrippedLen = end - begin;
+    new->dataStrippedIdx = begin - data;
+    new->dataStripped = strndup(begin, new->dataStrippedLen);
+    COUNT(allocations, 2);
+    COUNT(bytesCopied, new->dataStrippedLen);
+    if (new->dataStripped == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
     new->next = head;
     if(head != NULL) {
         new->pos = head->pos + 1;
@@ -128,7 +315,7 @@ int countFilled(char* line, int len) {
     return filled;
 }
 
-char* padTrimLine(char* line) {
+char* padTrimLineShift(char* line, int* shift) {
     // Allocate and return a pointer to a new line. The returned string
     // will have at least 3 whitespaces in the beginning of the string
     // followed by the meaningful content of the old line with exactly 
@@ -141,6 +328,8 @@ char* padTrimLine(char* line) {
     // gliding or blinking, therefore, leading blanks are kept. 
     // Trailing blanks in excess of 3 can be removed since we know they will
     // not produce any new filled squares on the lines below the current line.
+    //
+    // The number of blanks added in the beginning is stored in shift.
     int len = strlen(line);
     int firstFilledIdx = getFirstFilledIdx(line);
     int lastFilledIdx = getLastFilledIdx(line);
@@ -157,14 +346,131 @@ char* padTrimLine(char* line) {
     memset(newline, ' ', newlen-1);
     newline[newlen-1] = '\0';
     memcpy(newline+lfill, line, lastFilledIdx + 1);
+    COUNT(allocations, 1);
+    COUNT(bytesCopied, lastFilledIdx + 1);
+    *shift = lfill;
     return newline;
 }
 
+char* padTrimLine(char* line) {
+    // padTrimLineShift without the shift
+    int shift;
+    return padTrimLineShift(line, &shift);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Engines fill the squares startIdx..stopIdx of the line below the given
+// line by the rules of fillNextLine and return the number of filled squares.
+// The line below must be initialized with whitespaces. All the engines give
+// the same result, but their speed depends on the width and the density of
+// the line, see selectEngine.
+typedef enum EngineId {
+    ENGINE_SCALAR = 0,
+    ENGINE_WINDOW,
+    ENGINE_SPARSE,
+    ENGINES,
+} EngineId;
+
+static const char* ENGINE_NAMES[ENGINES] = {
+    "scalar", "window", "sparse"
+};
+
+typedef int (*FillFunction)(char* above, char* below, int startIdx,
+    int stopIdx);
+
+bool isFilledBelow(char square, int filled) {
+    // Apply the rules on a square of the line above, given the number of
+    // filled squares in its block of 5 squares (including the square)
+    if(square == ' ') {
+        // Rule #1
+        return filled == 2 || filled == 3;
+    }
+    // Rule #2
+    // Note: we count the number of filled squares over the full block of 5
+    // squares, therefore checking for 3 or 5, not 2 or 4.
+    return filled == 3 || filled == 5;
+}
+
+int fillScalar(char* above, char* below, int startIdx, int stopIdx) {
+    // Count the filled squares of the block of every square
+    int population = 0;
+    for(int i=startIdx; i < stopIdx + 1; i++) {
+        // Pointer to block of 5 squares: 2 on each side of above[i]
+        char* block = &(above[i-2]);
+        if(isFilledBelow(above[i], countFilled(block, 5))) {
+            below[i] = FILLED;
+            population++;
+        }
+    }
+    return population;
+}
+
+int fillWindow(char* above, char* below, int startIdx, int stopIdx) {
+    // Keep a running count of the filled squares in the block of 5 squares
+    // as it slides over the line, instead of counting every block again
+    int population = 0;
+    int filled = countFilled(&(above[startIdx-2]), 5);
+    for(int i=startIdx; i < stopIdx + 1; i++) {
+        if(isFilledBelow(above[i], filled)) {
+            below[i] = FILLED;
+            population++;
+        }
+        filled += (above[i+3] == FILLED) - (above[i-2] == FILLED);
+    }
+    return population;
+}
+
+int fillSparse(char* above, char* below, int startIdx, int stopIdx) {
+    // Like fillWindow, but jump over the runs of blank blocks: a square can
+    // only be filled if a square of its block is filled. The next filled
+    // square is found with strspn, which is much faster than stepping one
+    // square at a time on mostly blank lines.
+    int population = 0;
+    int filled = countFilled(&(above[startIdx-2]), 5);
+    int i = startIdx;
+    while(i < stopIdx + 1) {
+        if(filled == 0) {
+            // The block of the square 2 squares before the next filled
+            // square is the first one to contain it
+            i += 1 + strspn(&(above[i+3]), " ");
+            filled = 1;
+            continue;
+        }
+        if(isFilledBelow(above[i], filled)) {
+            below[i] = FILLED;
+            population++;
+        }
+        filled += (above[i+3] == FILLED) - (above[i-2] == FILLED);
+        i++;
+    }
+    return population;
+}
+
+static const FillFunction ENGINE_FILLS[ENGINES] = {
+    fillScalar, fillWindow, fillSparse
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 
 typedef struct GameState {
     // Stack of lines: linesHead always points to the last added line
     StackEntry* linesHead;
+    // Temporary buffer used when filling the next line
+    char* scratch;
+    int scratchSize;
+    // Earlier line the last line was found to repeat by detectPattern
+    StackEntry* match;
+    // Number of bytes allocated for the game so far
+    size_t allocBytes;
+    // Bytes of the lines on the stack
+    size_t historyBytes;
+    // Engine used by fillNextLine
+    EngineId engine;
+    // Column of the first square of the last line on the input line
+    int origin;
+    // Number of filled squares on the last filled line
+    int population;
 } GameState;
 
 GameState* newGameState(char* firstline) {
@@ -174,7 +480,12 @@ GameState* newGameState(char* firstline) {
         printf("ERROR: memory allocation failed\n");
         exit(1);
     }
+    COUNT(allocations, 1);
     game->linesHead = push(game->linesHead, firstline);
+    game->historyBytes = sizeof(GameState) + sizeof(StackEntry) + 
+        game->linesHead->dataStrlen + game->linesHead->dataStrippedLen + 2;
+    game->allocBytes = game->historyBytes;
+    memAdd(MEM_HISTORY, game->historyBytes);
     return game;
 }
 
@@ -188,6 +499,9 @@ void deallocateGameState(GameState* this) {
         free(next);
         next = tmp;
     }
+    memSub(MEM_HISTORY, this->historyBytes);
+    memSub(MEM_ROW_BUFFERS, this->scratchSize);
+    free(this->scratch);
     free(this);
 }
 
@@ -196,6 +510,21 @@ uint8_t linesFilled(GameState* this) {
     return (this->linesHead->pos + 1);
 }
 
+void pushFilledLine(GameState* this, char* templine) {
+    // Push the line filled in templine, which is as long as the last line,
+    // on the stack of the game. padTrimLine allocates new buffer.
+    int shift;
+    char* newline = padTrimLineShift(templine, &shift);
+    this->origin -= shift;
+    //printf("[+] newline:%s\n", newline);
+    this->linesHead = push(this->linesHead, newline);
+    size_t bytes = sizeof(StackEntry) + this->linesHead->dataStrlen + 
+        this->linesHead->dataStrippedLen + 2;
+    this->allocBytes += bytes;
+    this->historyBytes += bytes;
+    memAdd(MEM_HISTORY, bytes);
+}
+
 void fillNextLine(GameState* this) {
     // "The filling of each square is defined by the square above it and 4
     // squares next to it (2 squares on each sides).
@@ -219,40 +548,49 @@ void fillNextLine(GameState* this) {
     // Squares after it will be empty. 
     int stopIdx = getLastFilledIdx(lineAbove) + 1;
 
-    // Use global variable TEMPLINE as a buffer when filling the line.
-    // Initialize with whitespaces.
-    memset(TEMPLINE, ' ', len-1);
-    TEMPLINE[len-1] = '\0';
-
-    for(int i=startIdx; i < stopIdx + 1; i++) {
-        // Pointer to block of 5 squares: 2 on each side of lineAbove[i]
-        char* block = &(lineAbove[i-2]);
-        int filled = countFilled(block, 5);
-        if(lineAbove[i] == ' ') {
-            // Rule #1
-            if(filled == 2 || filled == 3) {
-                TEMPLINE[i] = FILLED;
-            }
-        }
-        else {
-            // Rule #2
-            // Note: we count the number of filled squares over the
-            // full block of 5 squares, therefore checking for 3 or 5,
-            // not 2 or 4.
-            if(filled == 3 || filled == 5) {
-                TEMPLINE[i] = FILLED;
-            }
+    // Fill the line in the scratch buffer of the game, every game has its 
+    // own so that games can be played in parallel. Initialize with 
+    // whitespaces.
+    if(this->scratchSize < len) {
+        memSub(MEM_ROW_BUFFERS, this->scratchSize);
+        memAdd(MEM_ROW_BUFFERS, len);
+        free(this->scratch);
+        this->scratch = malloc(len);
+        if(this->scratch == NULL) {
+            printf("ERROR: memory allocation failed\n");
+            exit(1);
         }
+        this->scratchSize = len;
+        this->allocBytes += len;
+        COUNT(allocations, 1);
     }
-    // padTrimLine allocates new buffer
-    char* newline = padTrimLine(TEMPLINE);
-    //printf("[+] newline:%s\n", newline);
-    this->linesHead = push(this->linesHead, newline);
+    char* templine = this->scratch;
+    memset(templine, ' ', len-1);
+    templine[len-1] = '\0';
+    COUNT(rounds, 1);
+    COUNT(cells, stopIdx - startIdx + 1);
+    this->population = ENGINE_FILLS[this->engine](lineAbove, templine,
+        startIdx, stopIdx);
+    pushFilledLine(this, templine);
 }
 
-bool printPattern(GameState* this) {
-    // Prints the pattern name and returns true if the pattern can be
-    // recognized based on the lines filled thus far. Otherwise, return false.
+typedef enum Pattern {
+    // No pattern recognized yet
+    PATTERN_NONE = 0,
+    PATTERN_VANISHING,
+    PATTERN_BLINKING,
+    PATTERN_GLIDING,
+    PATTERN_OTHER,
+} Pattern;
+
+// Pattern names as printed on the output, indexed by Pattern
+static const char* PATTERN_NAMES[] = {
+    "none", "vanishing", "blinking", "gliding", "other"
+};
+
+Pattern detectPattern(GameState* this) {
+    // Return the pattern that can be recognized based on the lines filled
+    // thus far, or PATTERN_NONE if the pattern can not be recognized yet.
     char* lastline = this->linesHead->data;
     char* lastlineStripped = this->linesHead->dataStripped;
 
@@ -262,101 +600,4650 @@ bool printPattern(GameState* this) {
     for(entry = this->linesHead->next; entry != NULL; entry = entry->next) {
         // vanishing: there are no colored squares on a line
         if(lastlineStripped[0] == '\0') {
-            printf("vanishing\n");
-            return true;
+            return PATTERN_VANISHING;
         }
         // blinking: the pattern and location of colored squares is exactly 
         // the same as in some of the preceding lines
+        COUNT(comparisons, 1);
         if(strcmp(lastline, entry->data) == 0) {
-            printf("blinking\n");
-            return true;
+            this->match = entry;
+            return PATTERN_BLINKING;
         }
         // gliding: the pattern of colored squares is the same as in some of 
         // the preceding lines, but is located in different position
+        COUNT(comparisons, 1);
         if(strcmp(lastlineStripped, entry->dataStripped) == 0) {
-            printf("gliding\n");
-            return true;
+            this->match = entry;
+            return PATTERN_GLIDING;
         }
     }
 
     // other: None of the preceding types is detected when the last line was 
     // reached
     if(linesFilled(this) >= MAX_ROUNDS) {
-        printf("other\n");
-        return true;
+        return PATTERN_OTHER;
     }
 
-    return false;
+    return PATTERN_NONE;
+}
+
+bool printPattern(GameState* this) {
+    // Prints the pattern name and returns true if the pattern can be
+    // recognized based on the lines filled thus far. Otherwise, return false.
+    Pattern pattern = detectPattern(this);
+    if(pattern == PATTERN_NONE) {
+        return false;
+    }
+    printf("%s\n", PATTERN_NAMES[pattern]);
+    return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void play(char* textfile) {
-    char* line = NULL;
-    size_t len = 0;
-    ssize_t read;
-    FILE *fp = fopen(textfile,"r");
+// Hardware performance counters are read with perf_event_open around the
+// simulation (fillNextLine) and detection (detectPattern) phases of each
+// round. The counters of a thread are opened as one group, so they are
+// read with a single system call and scheduled on the PMU together. The raw
+// counts are accumulated together with the time the group was enabled and
+// running, and scaled up for multiplexing only when the report is written.
+#define PERF_COUNTERS 4
 
-    if(!fp) {
-        fprintf(stderr,"ERROR: failed to open file: \"%s\"\n", textfile);
+static const char* PERF_COUNTER_NAMES[PERF_COUNTERS] = {
+    "cycles", "instructions", "cache-misses", "branch-misses"
+};
+
+static const uint64_t PERF_COUNTER_CONFIGS[PERF_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+// Values read from a group: the counters, the time enabled and the time
+// running
+#define PERF_VALUES (PERF_COUNTERS + 2)
+#define PERF_ENABLED PERF_COUNTERS
+#define PERF_RUNNING (PERF_COUNTERS + 1)
+
+typedef enum PerfPhase {
+    PHASE_SIMULATION = 0,
+    PHASE_DETECTION,
+    PERF_PHASES,
+} PerfPhase;
+
+static const char* PERF_PHASE_NAMES[PERF_PHASES] = {
+    "simulation", "detection"
+};
+
+typedef struct PerfCounters {
+    // Group leader is fds[0]. Counters the CPU does not support are -1.
+    int fds[PERF_COUNTERS];
+    // Position of each counter in the values read from the group
+    int index[PERF_COUNTERS];
+    int opened;
+    // Raw counter values followed by the time enabled and the time running
+    // at the beginning of the current phase, started is false if they could
+    // not be read
+    uint64_t start[PERF_VALUES];
+    bool started;
+    // Raw counts and times of the phases
+    uint64_t totals[ENGINES][PERF_PHASES][PERF_VALUES];
+    uint64_t calls[ENGINES][PERF_PHASES];
+    struct PerfCounters* next;
+} PerfCounters;
+
+// Counters of the calling thread, NULL if not counting
+static __thread PerfCounters* PERF;
+
+// All the counters that have been opened, one per thread
+static PerfCounters* PERF_ALL;
+static pthread_mutex_t PERF_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+// Report is written on PERF_REPORT, if not NULL
+static FILE* PERF_REPORT;
+
+PerfCounters* openPerfCounters(void) {
+    // Open the counters for the calling thread. Return NULL and print a
+    // warning if the counters are not available.
+    PerfCounters* perf = calloc(1, sizeof(PerfCounters));
+    if(perf == NULL) {
+        printf("ERROR: memory allocation failed\n");
         exit(1);
     }
+    for(int i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNTER_CONFIGS[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | 
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perf->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1,
+            i == 0 ? -1 : perf->fds[0], 0);
+        if(perf->fds[i] < 0 && i == 0) {
+            // Warn only once, not for every thread
+            static int warned;
+            if(!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+                fprintf(stderr, "WARNING: performance counters are not "
+                    "available: %s\n", strerror(errno));
+            }
+            free(perf);
+            return NULL;
+        }
+        perf->index[i] = perf->fds[i] < 0 ? -1 : perf->opened++;
+    }
+    memAdd(MEM_INSTRUMENTATION, sizeof(PerfCounters));
+    pthread_mutex_lock(&PERF_LOCK);
+    perf->next = PERF_ALL;
+    PERF_ALL = perf;
+    pthread_mutex_unlock(&PERF_LOCK);
+    return perf;
+}
+
+bool readPerfCounters(PerfCounters* perf, uint64_t* values) {
+    // Read the current raw counter values and the times the group was
+    // enabled and running. Return false if the counters could not be read.
+    uint64_t data[3 + PERF_COUNTERS];
+    if(perf->fds[0] < 0 ||
+       read(perf->fds[0], data, sizeof(data)) < (ssize_t)(3 * sizeof(uint64_t)
+       + perf->opened * sizeof(uint64_t))) {
+        return false;
+    }
+    // data: number of counters, time enabled, time running, values
+    for(int i = 0; i < PERF_COUNTERS; i++) {
+        values[i] = perf->index[i] >= 0 ? data[3 + perf->index[i]] : 0;
+    }
+    values[PERF_ENABLED] = data[1];
+    values[PERF_RUNNING] = data[2];
+    return true;
+}
+
+void closePerfCounters(void) {
+    // Close the counters of the calling thread. Their totals stay in
+    // PERF_ALL for the report.
+    if(PERF != NULL) {
+        for(int i = PERF_COUNTERS - 1; i >= 0; i--) {
+            if(PERF->fds[i] >= 0) {
+                close(PERF->fds[i]);
+                PERF->fds[i] = -1;
+            }
+        }
+        PERF = NULL;
+    }
+}
+
+void perfBegin(void) {
+    if(PERF != NULL) {
+        PERF->started = readPerfCounters(PERF, PERF->start);
+    }
+}
+
+void perfEnd(EngineId engine, PerfPhase phase) {
+    if(PERF != NULL && PERF->started) {
+        uint64_t values[PERF_VALUES];
+        if(!readPerfCounters(PERF, values)) {
+            return;
+        }
+        for(int i = 0; i < PERF_VALUES; i++) {
+            PERF->totals[engine][phase][i] += values[i] - PERF->start[i];
+        }
+        PERF->calls[engine][phase]++;
+    }
+}
 
-    while((read = getline(&line, &len, fp)) != -1) {
-        // Ignore blank lines
-        if(read == 1) {
+void writePerfReport(FILE* out) {
+    // Sum the counters of all the threads and write the totals per engine
+    // and phase. Must not be called while the counting threads are still
+    // running. The counts are scaled up by the time enabled over the time
+    // running, in case the counters were multiplexed with other events.
+    uint64_t totals[ENGINES][PERF_PHASES][PERF_VALUES] = {{{0}}};
+    uint64_t calls[ENGINES][PERF_PHASES] = {{0}};
+    bool supported[PERF_COUNTERS] = {false};
+    for(PerfCounters* perf = PERF_ALL; perf != NULL; perf = perf->next) {
+        for(int e = 0; e < ENGINES; e++) {
+            for(int p = 0; p < PERF_PHASES; p++) {
+                for(int i = 0; i < PERF_VALUES; i++) {
+                    totals[e][p][i] += perf->totals[e][p][i];
+                }
+                calls[e][p] += perf->calls[e][p];
+            }
+        }
+        for(int i = 0; i < PERF_COUNTERS; i++) {
+            supported[i] |= perf->index[i] >= 0;
+        }
+    }
+    if(PERF_ALL == NULL) {
+        fprintf(out, "# performance counters not available\n");
+        return;
+    }
+    fprintf(out, "# %-8s %-10s %12s", "engine", "phase", "rounds");
+    for(int i = 0; i < PERF_COUNTERS; i++) {
+        fprintf(out, " %16s", PERF_COUNTER_NAMES[i]);
+    }
+    fprintf(out, " %8s %12s\n", "IPC", "cycles/round");
+    for(int e = 0; e < ENGINES; e++) {
+        if(calls[e][PHASE_SIMULATION] == 0) {
+            // Engine not used
             continue;
         }
-        if(read > MAX_LINE_LEN) {
-            fprintf(stderr,
-                "ERROR: file contains lines longer than %d characters\n", 
-                MAX_LINE_LEN);
+        for(int p = 0; p < PERF_PHASES; p++) {
+            uint64_t* raw = totals[e][p];
+            double scale = raw[PERF_RUNNING] > 0 ?
+                (double)raw[PERF_ENABLED] / raw[PERF_RUNNING] : 0;
+            uint64_t t[PERF_COUNTERS];
+            for(int i = 0; i < PERF_COUNTERS; i++) {
+                t[i] = raw[i] * scale;
+            }
+            fprintf(out, "%-10s %-10s %12llu", ENGINE_NAMES[e],
+                PERF_PHASE_NAMES[p], (unsigned long long)calls[e][p]);
+            for(int i = 0; i < PERF_COUNTERS; i++) {
+                if(supported[i]) {
+                    fprintf(out, " %16llu", (unsigned long long)t[i]);
+                }
+                else {
+                    fprintf(out, " %16s", "n/a");
+                }
+            }
+            fprintf(out, " %8.2f %12.1f\n",
+                t[0] ? (double)t[1] / t[0] : 0.0,
+                calls[e][p] ? (double)t[0] / calls[e][p] : 0.0);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint64_t nowNs(void) {
+    // Monotonic time in nanoseconds
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The engine of a line is chosen from its width and the density of its
+// filled squares, using a table with an engine for every width and density
+// bucket. The table is calibrated by timing the engines on random lines on
+// the local CPU, and cached in a small file so that the calibration only
+// runs once per CPU, version of the engines and compiler: the file records
+// all three. TUNE_VERSION must be bumped whenever an engine changes. Each
+// version and compiler has a file of its own, so builds installed side by
+// side do not overwrite each other's table.
+#define TUNE_VERSION 2
+#ifdef __VERSION__
+#define TUNE_COMPILER __VERSION__
+#else
+#define TUNE_COMPILER "unknown"
+#endif
+#define TUNE_WIDTHS 4
+#define TUNE_DENSITIES 3
+
+// Upper limits of the width buckets, and the width of the calibration lines
+static const int TUNE_WIDTH_LIMITS[TUNE_WIDTHS] = {64, 512, 4096, INT32_MAX};
+static const int TUNE_WIDTH_SAMPLES[TUNE_WIDTHS] = {32, 256, 2048, 8192};
+
+// Upper limits of the density buckets (filled squares per 64 squares), and
+// the density of the calibration lines
+static const int TUNE_DENSITY_LIMITS[TUNE_DENSITIES] = {8, 24, 64};
+static const int TUNE_DENSITY_SAMPLES[TUNE_DENSITIES] = {3, 16, 32};
+
+// Number of squares every engine fills per timing, and timings per engine
+#define TUNE_CELLS (1 << 16)
+#define TUNE_REPEATS 3
+
+static EngineId ENGINE_TABLE[TUNE_WIDTHS][TUNE_DENSITIES];
+
+// Engine forced with --engine, ENGINES for choosing automatically
+static EngineId FORCED_ENGINE = ENGINES;
+
+EngineId selectEngine(char* line, int width) {
+    // Choose the engine for a line with the given number of squares
+    if(FORCED_ENGINE != ENGINES) {
+        return FORCED_ENGINE;
+    }
+    int w = 0;
+    while(width > TUNE_WIDTH_LIMITS[w]) {
+        w++;
+    }
+    int density = width > 0 ? 64L * countFilled(line, width) / width : 0;
+    int d = 0;
+    while(d < TUNE_DENSITIES - 1 && density >= TUNE_DENSITY_LIMITS[d]) {
+        d++;
+    }
+    return ENGINE_TABLE[w][d];
+}
+
+uint64_t timeEngine(EngineId engine, char* above, char* below) {
+    // Best time of filling TUNE_CELLS squares below the given line
+    int len = strlen(above);
+    int startIdx = getFirstFilledIdx(above) - 1;
+    int stopIdx = getLastFilledIdx(above) + 1;
+    int repeats = TUNE_CELLS / len + 1;
+    uint64_t best = UINT64_MAX;
+    for(int r = 0; r < TUNE_REPEATS; r++) {
+        uint64_t start = nowNs();
+        for(int i = 0; i < repeats; i++) {
+            memset(below, ' ', len);
+            ENGINE_FILLS[engine](above, below, startIdx, stopIdx);
+        }
+        uint64_t elapsed = nowNs() - start;
+        if(elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+void calibrateEngines(void) {
+    // Fill ENGINE_TABLE with the fastest engine of every bucket
+    uint64_t random = 0x9E3779B97F4A7C15ULL;
+    for(int w = 0; w < TUNE_WIDTHS; w++) {
+        int width = TUNE_WIDTH_SAMPLES[w];
+        char* line = malloc(width + 1);
+        char* below = malloc(width + 8);
+        if(line == NULL || below == NULL) {
+            printf("ERROR: memory allocation failed\n");
             exit(1);
         }
-        // Remove newline from the end of the line
-        if(line[read-1] == '\n') {
-           line[read-1] = '\0';
-           --read;
-        }
-        // Check that the line contains only expected characters.
-        // Replace EMPTY markers from the input line with whitespaces.
-        for(int i = 0; i < read; ++i) {
-            if(!(line[i] == EMPTY || line[i] == FILLED)) {
-                fprintf(stderr,
-                    "ERROR: unexpected characters on a line: \"%c\"\n",line[i]);
-                exit(1);
+        for(int d = 0; d < TUNE_DENSITIES; d++) {
+            for(int i = 0; i < width; i++) {
+                // xorshift64
+                random ^= random << 13;
+                random ^= random >> 7;
+                random ^= random << 17;
+                line[i] = (int)(random % 64) < TUNE_DENSITY_SAMPLES[d] ?
+                    FILLED : ' ';
             }
-            if(line[i] == EMPTY) {
-                line[i] = ' ';
+            line[0] = FILLED;
+            line[width-1] = FILLED;
+            line[width] = '\0';
+            char* above = padTrimLine(line);
+            uint64_t best = UINT64_MAX;
+            for(int e = 0; e < ENGINES; e++) {
+                uint64_t ns = timeEngine(e, above, below);
+                if(ns < best) {
+                    best = ns;
+                    ENGINE_TABLE[w][d] = e;
+                }
             }
+            free(above);
         }
-        char* trimmed = padTrimLine(line);
-        //printf("[+] first  :%s\n", trimmed);
+        free(line);
+        free(below);
+    }
+}
 
-        GameState* game = newGameState(trimmed);
-        while(linesFilled(game) < MAX_ROUNDS) {
-            fillNextLine(game); 
-            if(printPattern(game)) {
-                break;
-            }
+void getCpuName(char* name, int size) {
+    // Name of the CPU model from /proc/cpuinfo, "unknown" if not available
+    snprintf(name, size, "unknown");
+    FILE* fp = fopen("/proc/cpuinfo", "r");
+    if(fp == NULL) {
+        return;
+    }
+    char buffer[256];
+    while(fgets(buffer, sizeof(buffer), fp) != NULL) {
+        char* value = strchr(buffer, ':');
+        if(strncmp(buffer, "model name", 10) == 0 && value != NULL) {
+            value = stripLeft(value + 1);
+            value[strcspn(value, "\n")] = '\0';
+            snprintf(name, size, "%s", value);
+            break;
         }
-        deallocateGameState(game);
     }
+    fclose(fp);
+}
+
+char* defaultTuneFile(void) {
+    // $XDG_CACHE_HOME/back-to-school/engines-V-C or
+    // $HOME/.cache/back-to-school/engines-V-C, where V is TUNE_VERSION and C
+    // the FNV-1a hash of TUNE_COMPILER. NULL if neither variable is set.
+    static char path[4096];
+    char* cache = getenv("XDG_CACHE_HOME");
+    char* home = getenv("HOME");
+    if(cache != NULL && cache[0] != '\0') {
+        snprintf(path, sizeof(path), "%s", cache);
+    }
+    else if(home != NULL && home[0] != '\0') {
+        snprintf(path, sizeof(path), "%s/.cache", home);
+    }
+    else {
+        return NULL;
+    }
+    uint32_t compiler = 2166136261u;
+    for(const char* c = TUNE_COMPILER; *c != '\0'; c++) {
+        compiler = (compiler ^ (unsigned char)*c) * 16777619u;
+    }
+    size_t len = strlen(path);
+    snprintf(path + len, sizeof(path) - len,
+        "/back-to-school/engines-%d-%08x", TUNE_VERSION, compiler);
+    return path;
+}
 
+bool readTuneFile(char* path, char* cpu) {
+    // Read the engine table from the given file. Return false if the file
+    // does not exist or was written by another version, by another compiler
+    // or on another CPU.
+    FILE* fp = fopen(path, "r");
+    if(fp == NULL) {
+        return false;
+    }
+    char buffer[256];
+    char cpuLine[256];
+    int version = 0;
+    snprintf(cpuLine, sizeof(cpuLine), "cpu %s\n", cpu);
+    // Header, CPU, compiler and comment lines followed by the table
+    bool valid = fgets(buffer, sizeof(buffer), fp) != NULL &&
+        sscanf(buffer, "back-to-school engines %d", &version) == 1 &&
+        version == TUNE_VERSION && 
+        fgets(buffer, sizeof(buffer), fp) != NULL &&
+        strcmp(buffer, cpuLine) == 0 &&
+        fgets(buffer, sizeof(buffer), fp) != NULL &&
+        strcmp(buffer, "compiler " TUNE_COMPILER "\n") == 0 &&
+        fgets(buffer, sizeof(buffer), fp) != NULL && buffer[0] == '#';
+    for(int w = 0; w < TUNE_WIDTHS && valid; w++) {
+        for(int d = 0; d < TUNE_DENSITIES && valid; d++) {
+            char name[16];
+            int e = 0;
+            valid = fscanf(fp, "%15s", name) == 1;
+            while(valid && e < ENGINES && strcmp(name, ENGINE_NAMES[e])) {
+                e++;
+            }
+            valid = valid && e < ENGINES;
+            ENGINE_TABLE[w][d] = e;
+        }
+    }
     fclose(fp);
-    free(line);
+    return valid;
+}
+
+void writeTuneFile(char* path, char* cpu) {
+    // Write the engine table on the given file, creating its directories
+    // if needed. A temporary file is renamed over the file, so that
+    // concurrent runs never read half a table. The table is only a cache,
+    // so errors are ignored.
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for(char* slash = strchr(tmp + 1, '/'); slash != NULL;
+        slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(tmp, 0755);
+        *slash = '/';
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE* fp = fopen(tmp, "w");
+    if(fp == NULL) {
+        return;
+    }
+    fprintf(fp, "back-to-school engines %d\n", TUNE_VERSION);
+    fprintf(fp, "cpu %s\n", cpu);
+    fprintf(fp, "compiler %s\n", TUNE_COMPILER);
+    fprintf(fp, "# one row per width bucket (up to");
+    for(int w = 0; w < TUNE_WIDTHS - 1; w++) {
+        fprintf(fp, " %d", TUNE_WIDTH_LIMITS[w]);
+    }
+    fprintf(fp, " and wider), one column per density bucket (up to");
+    for(int d = 0; d < TUNE_DENSITIES; d++) {
+        fprintf(fp, " %d", TUNE_DENSITY_LIMITS[d]);
+    }
+    fprintf(fp, " per 64 squares)\n");
+    for(int w = 0; w < TUNE_WIDTHS; w++) {
+        for(int d = 0; d < TUNE_DENSITIES; d++) {
+            fprintf(fp, "%s%s", d > 0 ? " " : "", 
+                ENGINE_NAMES[ENGINE_TABLE[w][d]]);
+        }
+        fprintf(fp, "\n");
+    }
+    if(fclose(fp) != 0 || rename(tmp, path) != 0) {
+        remove(tmp);
+    }
+}
+
+void tuneEngines(char* path) {
+    // Load the engine table from the given file, or calibrate it and write
+    // it on the file if it is missing or out of date. Without a file the
+    // table is calibrated on every run.
+    char cpu[128];
+    getCpuName(cpu, sizeof(cpu));
+    if(path != NULL && readTuneFile(path, cpu)) {
+        return;
+    }
+    calibrateEngines();
+    if(path != NULL) {
+        writeTuneFile(path, cpu);
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-int main(int argc, char *argv[]) {
-    if(argc < 2) {
-        printf("Usage: %s <textfile>\n", argv[0]);
-        return 0;
+// Spans of the phases of a run are recorded per thread and written at exit
+// in the Chrome Trace Event format (chrome://tracing, Perfetto). At most
+// TRACE_MAX_EVENTS spans are kept per thread; later spans are counted but
+// dropped.
+#define TRACE_MAX_EVENTS (1 << 20)
+
+typedef struct TraceEvent {
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+    // Line number and pattern of per-line spans, 0 and PATTERN_NONE for
+    // other spans
+    long lineNo;
+    Pattern pattern;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    const char* threadName;
+    int tid;
+    TraceEvent* events;
+    int count;
+    long dropped;
+    struct TraceBuffer* next;
+} TraceBuffer;
+
+// Trace buffer of the calling thread, NULL if not tracing
+static __thread TraceBuffer* TRACE;
+
+// All the trace buffers, one per thread
+static TraceBuffer* TRACE_ALL;
+static pthread_mutex_t TRACE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+// Trace is written on TRACE_FILE, if not NULL. Timestamps are relative to
+// TRACE_START.
+static FILE* TRACE_FILE;
+static uint64_t TRACE_START;
+
+TraceBuffer* newTraceBuffer(const char* threadName) {
+    // Allocate and register a trace buffer for the calling thread
+    TraceBuffer* trace = calloc(1, sizeof(TraceBuffer));
+    if(trace != NULL) {
+        trace->events = malloc(TRACE_MAX_EVENTS * sizeof(TraceEvent));
+    }
+    if(trace == NULL || trace->events == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    trace->threadName = threadName;
+    memAdd(MEM_INSTRUMENTATION,
+        sizeof(TraceBuffer) + TRACE_MAX_EVENTS * sizeof(TraceEvent));
+    pthread_mutex_lock(&TRACE_LOCK);
+    trace->tid = TRACE_ALL != NULL ? TRACE_ALL->tid + 1 : 1;
+    trace->next = TRACE_ALL;
+    TRACE_ALL = trace;
+    pthread_mutex_unlock(&TRACE_LOCK);
+    return trace;
+}
+
+uint64_t traceBegin(void) {
+    // Return the start time for traceEnd, or 0 if not tracing
+    return TRACE != NULL ? nowNs() : 0;
+}
+
+void traceEnd(const char* name, uint64_t start, long lineNo, 
+              Pattern pattern) {
+    // Record a span from start (returned by traceBegin) until now
+    if(TRACE == NULL) {
+        return;
+    }
+    if(TRACE->count == TRACE_MAX_EVENTS) {
+        TRACE->dropped++;
+        return;
+    }
+    TraceEvent* event = &TRACE->events[TRACE->count++];
+    event->name = name;
+    event->start = start;
+    event->duration = nowNs() - start;
+    event->lineNo = lineNo;
+    event->pattern = pattern;
+}
+
+void writeTrace(FILE* out) {
+    // Write all the recorded spans. Must not be called while the traced
+    // threads are still running.
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for(TraceBuffer* trace = TRACE_ALL; trace != NULL; trace = trace->next) {
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s\",\"dropped_spans\":%ld}}",
+            first ? "" : ",\n", trace->tid, trace->threadName, 
+            trace->dropped);
+        first = false;
+        for(int i = 0; i < trace->count; i++) {
+            TraceEvent* event = &trace->events[i];
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", event->name,
+                trace->tid, (event->start - TRACE_START) / 1e3,
+                event->duration / 1e3);
+            if(event->lineNo > 0) {
+                fprintf(out, ",\"args\":{\"line\":%ld", event->lineNo);
+                if(event->pattern != PATTERN_NONE) {
+                    fprintf(out, ",\"class\":\"%s\"",
+                        PATTERN_NAMES[event->pattern]);
+                }
+                fputc('}', out);
+            }
+            fputc('}', out);
+        }
+    }
+    fprintf(out, "\n]}\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Space-time diagrams of the selected input lines are written as binary PBM
+// (P4) images, one file per line with one image row per filled line. Rows
+// are written as soon as they are filled, so the image is never held in
+// memory. The image spans every square the filled squares can reach: they
+// spread by at most one square per round on both sides of the input line.
+
+typedef struct LineRange {
+    long first;
+    long last;
+} LineRange;
+
+bool parseLineRanges(char* text, LineRange** ranges, int* count) {
+    // Parse a comma separated list of line numbers and ranges of line
+    // numbers, e.g. "1,5,10-20". Return false on errors.
+    *count = 0;
+    *ranges = NULL;
+    while(true) {
+        char* end;
+        long first = strtol(text, &end, 10);
+        long last = first;
+        if(end == text || first < 1) {
+            return false;
+        }
+        if(*end == '-') {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if(end == text || last < first) {
+                return false;
+            }
+        }
+        *ranges = realloc(*ranges, (*count + 1) * sizeof(LineRange));
+        if(*ranges == NULL) {
+            printf("ERROR: memory allocation failed\n");
+            exit(1);
+        }
+        (*ranges)[*count].first = first;
+        (*ranges)[*count].last = last;
+        (*count)++;
+        if(*end == '\0') {
+            return true;
+        }
+        if(*end != ',') {
+            return false;
+        }
+        text = end + 1;
+    }
+}
+
+// Diagrams are written on DIAGRAM_PREFIX-<line number>.pbm, if not NULL,
+// for the lines in DIAGRAM_LINES or for all lines if there are no ranges
+static char* DIAGRAM_PREFIX;
+static LineRange* DIAGRAM_LINES;
+static int DIAGRAM_RANGES;
+
+typedef struct Diagram {
+    FILE* fp;
+    // Offset of the height in the header. The height is written in a fixed
+    // width field when the diagram is closed.
+    long heightOffset;
+    int width;
+    int height;
+    // Column of the first pixel on the input line
+    int left;
+    // Packed pixels of a row, 1 is a filled square
+    uint8_t* row;
+    int rowBytes;
+} Diagram;
+
+bool isDiagramLine(long lineNo) {
+    for(int i = 0; i < DIAGRAM_RANGES; i++) {
+        LineRange* range = &DIAGRAM_LINES[i];
+        if(lineNo >= range->first && lineNo <= range->last) {
+            return true;
+        }
+    }
+    return DIAGRAM_RANGES == 0;
+}
+
+Diagram* openDiagram(long lineNo, int width) {
+    // Create the diagram of the given input line, NULL if the line is not
+    // selected
+    if(DIAGRAM_PREFIX == NULL || !isDiagramLine(lineNo)) {
+        return NULL;
+    }
+    Diagram* diagram = calloc(1, sizeof(Diagram));
+    if(diagram == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s-%ld.pbm", DIAGRAM_PREFIX, lineNo);
+    diagram->fp = fopen(path, "wb");
+    if(diagram->fp == NULL) {
+        fprintf(stderr,"ERROR: failed to open file: \"%s\"\n", path);
+        exit(1);
     }
+    diagram->left = -(MAX_ROUNDS - 1);
+    diagram->width = width + 2 * (MAX_ROUNDS - 1);
+    diagram->rowBytes = (diagram->width + 7) / 8;
+    diagram->row = malloc(diagram->rowBytes);
+    if(diagram->row == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    memAdd(MEM_ROW_BUFFERS, diagram->rowBytes);
+    fprintf(diagram->fp, "P4\n# back-to-school line %ld\n%d ", lineNo,
+        diagram->width);
+    diagram->heightOffset = ftell(diagram->fp);
+    fprintf(diagram->fp, "%10d\n", 0);
+    return diagram;
+}
 
-    char *textfile = argv[1];
-    play(textfile);
+void writeDiagramRow(Diagram* diagram, GameState* game) {
+    // Append the last line of the game to the diagram, if not NULL
+    if(diagram == NULL) {
+        return;
+    }
+    StackEntry* entry = game->linesHead;
+    memset(diagram->row, 0, diagram->rowBytes);
+    for(int i = 0; i < entry->dataStrlen; i++) {
+        int x = game->origin + i - diagram->left;
+        if(entry->data[i] == FILLED && x >= 0 && x < diagram->width) {
+            diagram->row[x >> 3] |= 0x80 >> (x & 7);
+        }
+    }
+    fwrite(diagram->row, 1, diagram->rowBytes, diagram->fp);
+    diagram->height++;
+}
+
+void closeDiagram(Diagram* diagram) {
+    // Write the height in the header and close the diagram, if not NULL
+    if(diagram == NULL) {
+        return;
+    }
+    fseek(diagram->fp, diagram->heightOffset, SEEK_SET);
+    fprintf(diagram->fp, "%10d", diagram->height);
+    if(fclose(diagram->fp) != 0) {
+        fprintf(stderr, "ERROR: failed to write diagram: %s\n",
+            strerror(errno));
+        exit(1);
+    }
+    memSub(MEM_ROW_BUFFERS, diagram->rowBytes);
+    free(diagram->row);
+    free(diagram);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Population, live width and position of every filled line are recorded in
+// LineResult if TIMESERIES is not NULL, and written on it in columnar chunks
+typedef struct TimePoint {
+    int population;
+    // Number of squares from the first to the last filled square
+    int width;
+    // Column of the first filled square on the input line
+    int left;
+} TimePoint;
+
+static FILE* TIMESERIES;
+
+// The hash of every filled line is recorded in LineResult if INDEX is not
+// NULL, and written on it as an index of the lines reached by the input
+// lines. The lines are hashed without the blanks on both ends, so that the
+// same pattern at different positions has the same hash.
+static FILE* INDEX;
+
+uint64_t hashRow(char* row, int len) {
+    // 64-bit FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(int i = 0; i < len; i++) {
+        hash ^= (uint8_t)row[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+typedef struct LineResult {
+    // Line number in the input file, starting from 1
+    long lineNo;
+    // Pattern recognized on the line
+    Pattern pattern;
+    // Number of rounds played, i.e. lines filled after the first line
+    int rounds;
+    // Round of the earlier line the last line repeats (blinking and
+    // gliding), -1 if none
+    int matchRound;
+    // Rounds from that line to the last line, and the squares the filled
+    // squares moved right in the meantime (negative if left), 0 if none
+    int period;
+    int shift;
+    // Number of squares on the input line
+    int width;
+    // Widest extent of the filled squares over all the lines
+    int peakWidth;
+    // Time spent classifying the line, only measured if LINE_TIMING is set
+    uint64_t ns;
+    // Bytes allocated while classifying the line
+    size_t allocBytes;
+    // Engine that filled the lines
+    EngineId engine;
+    // Time series of the line, rounds + 1 points, if TIMESERIES is set
+    TimePoint* series;
+    // Hashes of the filled lines, rounds + 1 hashes, if INDEX is set
+    uint64_t* hashes;
+    // Number of catalogued objects the line was recognized as, 0 if the
+    // game was played
+    int objects;
+} LineResult;
+
+void recordTimePoint(TimePoint* series, GameState* game) {
+    // Record the last line of the game in the series, if not NULL
+    if(series == NULL) {
+        return;
+    }
+    StackEntry* entry = game->linesHead;
+    TimePoint* point = &series[entry->pos];
+    point->population = game->population;
+    point->width = entry->dataStrippedLen;
+    // Blank lines have no position
+    point->left = entry->dataStrippedLen > 0 ?
+        game->origin + entry->dataStrippedIdx : 0;
+}
+
+void recordHash(uint64_t* hashes, GameState* game) {
+    // Record the hash of the last line of the game, if hashes is not NULL
+    if(hashes != NULL) {
+        StackEntry* entry = game->linesHead;
+        hashes[entry->pos] = hashRow(entry->dataStripped,
+            entry->dataStrippedLen);
+    }
+}
+
+// Measure the time spent on each line in classifyLine
+static bool LINE_TIMING;
+
+// Catalog of known objects, NULL if not given. See recognizeLine.
+typedef struct Catalog Catalog;
+static Catalog* CATALOG;
+bool recognizeLine(Catalog* catalog, char* line, int width,
+                   LineResult* result);
+
+void classifyLine(char* line, LineResult* result) {
+    // Play the game on the given input line and store the recognized
+    // pattern in result. The line must already be validated with blanks
+    // replaced by whitespaces.
+    uint64_t start = LINE_TIMING ? nowNs() : 0;
+    uint64_t traceStart = traceBegin();
+    int width = strlen(line);
+    // Lines made of catalogued objects are classified without playing the
+    // game, unless the lines of the game are recorded
+    if(CATALOG != NULL && TIMESERIES == NULL && INDEX == NULL &&
+       (DIAGRAM_PREFIX == NULL || !isDiagramLine(result->lineNo)) &&
+       recognizeLine(CATALOG, line, width, result)) {
+        result->ns = LINE_TIMING ? nowNs() - start : 0;
+        traceEnd("line", traceStart, result->lineNo, result->pattern);
+        return;
+    }
+    int shift;
+    char* trimmed = padTrimLineShift(line, &shift);
+    //printf("[+] first  :%s\n", trimmed);
+
+    GameState* game = newGameState(trimmed);
+    game->engine = selectEngine(line, width);
+    game->origin = -shift;
+    Diagram* diagram = openDiagram(result->lineNo, width);
+    writeDiagramRow(diagram, game);
+    TimePoint* series = NULL;
+    if(TIMESERIES != NULL) {
+        series = malloc(MAX_ROUNDS * sizeof(TimePoint));
+        if(series == NULL) {
+            printf("ERROR: memory allocation failed\n");
+            exit(1);
+        }
+        memAdd(MEM_QUEUES, MAX_ROUNDS * sizeof(TimePoint));
+        game->population = countFilled(line, width);
+        recordTimePoint(series, game);
+    }
+    uint64_t* hashes = NULL;
+    if(INDEX != NULL) {
+        hashes = malloc(MAX_ROUNDS * sizeof(uint64_t));
+        if(hashes == NULL) {
+            printf("ERROR: memory allocation failed\n");
+            exit(1);
+        }
+        memAdd(MEM_QUEUES, MAX_ROUNDS * sizeof(uint64_t));
+        recordHash(hashes, game);
+    }
+    int peakWidth = game->linesHead->dataStrippedLen;
+    // Column of the first filled square of every line on the input line
+    int lefts[MAX_ROUNDS];
+    lefts[0] = game->origin + game->linesHead->dataStrippedIdx;
+    Pattern pattern = PATTERN_NONE;
+    while(linesFilled(game) < MAX_ROUNDS) {
+        perfBegin();
+        fillNextLine(game); 
+        perfEnd(game->engine, PHASE_SIMULATION);
+        lefts[game->linesHead->pos] = game->origin +
+            game->linesHead->dataStrippedIdx;
+        if(game->linesHead->dataStrippedLen > peakWidth) {
+            peakWidth = game->linesHead->dataStrippedLen;
+        }
+        writeDiagramRow(diagram, game);
+        recordTimePoint(series, game);
+        recordHash(hashes, game);
+        perfBegin();
+        uint64_t detectStart = traceBegin();
+        pattern = detectPattern(game);
+        traceEnd("detect", detectStart, result->lineNo, pattern);
+        perfEnd(game->engine, PHASE_DETECTION);
+        if(pattern != PATTERN_NONE) {
+            break;
+        }
+    }
+    result->pattern = pattern;
+    result->rounds = linesFilled(game) - 1;
+    result->matchRound = pattern == PATTERN_BLINKING || 
+        pattern == PATTERN_GLIDING ? game->match->pos : -1;
+    result->period = result->matchRound >= 0 ?
+        result->rounds - result->matchRound : 0;
+    result->shift = result->matchRound >= 0 ?
+        lefts[result->rounds] - lefts[result->matchRound] : 0;
+    result->width = width;
+    result->peakWidth = peakWidth;
+    result->allocBytes = game->allocBytes;
+    result->engine = game->engine;
+    result->series = series;
+    result->hashes = hashes;
+    result->objects = 0;
+    deallocateGameState(game);
+    closeDiagram(diagram);
+    result->ns = LINE_TIMING ? nowNs() - start : 0;
+    traceEnd("line", traceStart, result->lineNo, pattern);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Per-line latencies are recorded in HDR-style log-linear histograms: values
+// below 2^HIST_SUB_BITS ns are counted exactly, and every power of two range
+// above that is split into 2^(HIST_SUB_BITS-1) buckets. The relative error
+// of a reported value is therefore below 2^-(HIST_SUB_BITS-1), about 3%.
+// Values are clamped to 2^HIST_MAX_BITS ns, about 18 minutes.
+#define HIST_SUB_BITS 6
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) << (HIST_SUB_BITS-1))
+
+// Histograms are kept separately for each class and width bucket. Width
+// bucket i holds lines of at most 16*4^i squares, the last one the rest.
+#define HIST_WIDTH_BUCKETS 6
+
+typedef struct Histogram {
+    uint64_t counts[HIST_BUCKETS];
+} Histogram;
+
+typedef struct Histograms {
+    Histogram byClass[PATTERN_OTHER + 1][HIST_WIDTH_BUCKETS];
+    struct Histograms* next;
+} Histograms;
+
+// All the histograms that are being recorded, one set per thread
+static Histograms* HISTOGRAMS;
+static pthread_mutex_t HISTOGRAMS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+// Latency report is written on LATENCY, if not NULL
+static FILE* LATENCY;
+
+// Set by the SIGUSR1 handler to request a snapshot of the latency report
+static volatile sig_atomic_t LATENCY_SNAPSHOT;
+
+int histBucket(uint64_t value) {
+    if(value >= (1ULL << HIST_MAX_BITS)) {
+        value = (1ULL << HIST_MAX_BITS) - 1;
+    }
+    if(value < (1 << HIST_SUB_BITS)) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return (shift << (HIST_SUB_BITS - 1)) + (value >> shift);
+}
+
+uint64_t histBucketValue(int bucket) {
+    // Highest value that falls in the given bucket
+    if(bucket < (1 << HIST_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> (HIST_SUB_BITS - 1)) - 1;
+    uint64_t sub = bucket - (shift << (HIST_SUB_BITS - 1));
+    return ((sub + 1) << shift) - 1;
+}
+
+int widthBucket(int width) {
+    int bucket = 0;
+    for(long limit = 16; width > limit && bucket < HIST_WIDTH_BUCKETS - 1;
+        limit *= 4) {
+        bucket++;
+    }
+    return bucket;
+}
+
+Histograms* newHistograms(void) {
+    // Allocate a set of histograms for the calling thread and register it
+    // for the report
+    Histograms* hist = calloc(1, sizeof(Histograms));
+    if(hist == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    memAdd(MEM_INSTRUMENTATION, sizeof(Histograms));
+    pthread_mutex_lock(&HISTOGRAMS_LOCK);
+    hist->next = HISTOGRAMS;
+    HISTOGRAMS = hist;
+    pthread_mutex_unlock(&HISTOGRAMS_LOCK);
+    return hist;
+}
+
+void recordLatency(Histograms* hist, LineResult* result) {
+    // Only the owning thread writes to the histograms, but the report may
+    // read them at any time, hence the relaxed atomic accesses. They compile
+    // to plain loads and stores.
+    uint64_t* count = &hist->byClass[result->pattern]
+        [widthBucket(result->width)].counts[histBucket(result->ns)];
+    __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + 1,
+        __ATOMIC_RELAXED);
+}
+
+void writeHistogram(FILE* out, const char* class, const char* width,
+                    Histogram* hist) {
+    static const double PERCENTILES[] = {50, 90, 99, 99.9};
+    uint64_t total = 0;
+    int last = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++) {
+        total += hist->counts[i];
+        if(hist->counts[i] != 0) {
+            last = i;
+        }
+    }
+    if(total == 0) {
+        return;
+    }
+    fprintf(out, "%-10s %-7s %10llu", class, width, (unsigned long long)total);
+    int p = 0;
+    uint64_t seen = 0;
+    for(int i = 0; i < HIST_BUCKETS && p < 4; i++) {
+        seen += hist->counts[i];
+        // Nearest-rank percentiles
+        while(p < 4 && seen >= PERCENTILES[p] / 100 * total) {
+            fprintf(out, " %10.1f", histBucketValue(i) / 1e3);
+            p++;
+        }
+    }
+    fprintf(out, " %10.1f\n", histBucketValue(last) / 1e3);
+}
+
+void writeLatencyReport(FILE* out) {
+    // Merge the histograms of all the threads and write the percentiles by
+    // class, by width and by both
+    static Histogram merged[PATTERN_OTHER + 2][HIST_WIDTH_BUCKETS + 1];
+    memset(merged, 0, sizeof(merged));
+    pthread_mutex_lock(&HISTOGRAMS_LOCK);
+    for(Histograms* h = HISTOGRAMS; h != NULL; h = h->next) {
+        for(int c = PATTERN_VANISHING; c <= PATTERN_OTHER; c++) {
+            for(int w = 0; w < HIST_WIDTH_BUCKETS; w++) {
+                for(int i = 0; i < HIST_BUCKETS; i++) {
+                    uint64_t n = __atomic_load_n(&h->byClass[c][w].counts[i],
+                        __ATOMIC_RELAXED);
+                    // Row 0 and column HIST_WIDTH_BUCKETS are the totals
+                    merged[c][w].counts[i] += n;
+                    merged[c][HIST_WIDTH_BUCKETS].counts[i] += n;
+                    merged[0][w].counts[i] += n;
+                    merged[0][HIST_WIDTH_BUCKETS].counts[i] += n;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&HISTOGRAMS_LOCK);
+
+    fprintf(out, "# %-8s %-7s %10s %10s %10s %10s %10s %10s\n", "class",
+        "width", "lines", "p50[us]", "p90[us]", "p99[us]", "p99.9[us]",
+        "max[us]");
+    for(int c = 0; c <= PATTERN_OTHER; c++) {
+        // The totals over all widths first
+        for(int k = 0; k <= HIST_WIDTH_BUCKETS; k++) {
+            int w = (k + HIST_WIDTH_BUCKETS) % (HIST_WIDTH_BUCKETS + 1);
+            char width[16] = "all";
+            if(w == HIST_WIDTH_BUCKETS - 1) {
+                snprintf(width, sizeof(width), ">%d", 16 << (2 * (w - 1)));
+            }
+            else if(w < HIST_WIDTH_BUCKETS) {
+                snprintf(width, sizeof(width), "<=%d", 16 << (2 * w));
+            }
+            writeHistogram(out, c == 0 ? "all" : PATTERN_NAMES[c], width,
+                &merged[c][w]);
+        }
+    }
+    fflush(out);
+}
+
+void handleSigusr1(int sig) {
+    (void)sig;
+    LATENCY_SNAPSHOT = 1;
+}
+
+void checkLatencySnapshot(void) {
+    // Write a snapshot of the latency report if SIGUSR1 was received
+    if(LATENCY_SNAPSHOT && LATENCY != NULL) {
+        LATENCY_SNAPSHOT = 0;
+        fprintf(LATENCY, "# snapshot\n");
+        writeLatencyReport(LATENCY);
+        fflush(LATENCY);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+typedef enum LineStatus {
+    LINE_OK = 0,
+    // Blank lines are ignored
+    LINE_BLANK,
+    LINE_TOO_LONG,
+    LINE_UNEXPECTED_CHAR,
+} LineStatus;
+
+LineStatus prepareLine(char* line, ssize_t* read, char* unexpected) {
+    // Validate the line read from the input file and convert it in-place to
+    // the form expected by classifyLine. read is updated to the new length
+    // of the line. On LINE_UNEXPECTED_CHAR, the offending character is
+    // stored in unexpected.
+    if(*read == 1) {
+        return LINE_BLANK;
+    }
+    if(*read > MAX_LINE_LEN) {
+        return LINE_TOO_LONG;
+    }
+    // Remove newline from the end of the line
+    if(line[*read-1] == '\n') {
+       line[*read-1] = '\0';
+       --(*read);
+    }
+    // Check that the line contains only expected characters.
+    // Replace EMPTY markers from the input line with whitespaces.
+    for(int i = 0; i < *read; ++i) {
+        if(!(line[i] == EMPTY || line[i] == FILLED)) {
+            *unexpected = line[i];
+            return LINE_UNEXPECTED_CHAR;
+        }
+        if(line[i] == EMPTY) {
+            line[i] = ' ';
+        }
+    }
+    return LINE_OK;
+}
+
+void exitOnLineError(LineStatus status, char unexpected) {
+    if(status == LINE_TOO_LONG) {
+        fprintf(stderr,
+            "ERROR: file contains lines longer than %d characters\n", 
+            MAX_LINE_LEN);
+    }
+    else {
+        fprintf(stderr,
+            "ERROR: unexpected characters on a line: \"%c\"\n", unexpected);
+    }
+    exit(1);
+}
+
+FILE* openInput(char* textfile) {
+    FILE *fp = fopen(textfile,"r");
+    if(!fp) {
+        fprintf(stderr,"ERROR: failed to open file: \"%s\"\n", textfile);
+        exit(1);
+    }
+    return fp;
+}
+
+// Results are printed on OUTPUT. If UNORDERED, they are printed in the order
+// they are done, each after its input line number. If BINARY_RESULTS is not
+// NULL, they are written there instead, see writeBinaryResult.
+static FILE* OUTPUT;
+static bool UNORDERED;
+typedef struct BinaryRecord BinaryRecord;
+static BinaryRecord* BINARY_RESULTS;
+
+// Per-line statistics are written on STATS as JSON Lines, if not NULL
+static FILE* STATS;
+
+typedef struct StatsSummary {
+    long lines;
+    long classes[PATTERN_OTHER + 1];
+    long rounds;
+    uint64_t ns;
+    size_t allocBytes;
+    // Slowest line
+    uint64_t maxNs;
+    long maxNsLineNo;
+    int maxPeakWidth;
+} StatsSummary;
+
+static StatsSummary SUMMARY;
+
+void writeStats(FILE* stats, LineResult* result) {
+    fprintf(stats, "{\"line\":%ld,\"width\":%d,\"peak_width\":%d,"
+        "\"rounds\":%d,\"class\":\"%s\",\"match_round\":",
+        result->lineNo, result->width, result->peakWidth, result->rounds,
+        PATTERN_NAMES[result->pattern]);
+    if(result->matchRound >= 0) {
+        fprintf(stats, "%d", result->matchRound);
+    }
+    else {
+        fputs("null", stats);
+    }
+    fprintf(stats, ",\"period\":%d,\"shift\":%d,\"engine\":\"%s\","
+        "\"ns\":%llu,\"bytes\":%zu,\"objects\":%d}\n", result->period,
+        result->shift, ENGINE_NAMES[result->engine],
+        (unsigned long long)result->ns, result->allocBytes, result->objects);
+
+    SUMMARY.lines++;
+    SUMMARY.classes[result->pattern]++;
+    SUMMARY.rounds += result->rounds;
+    SUMMARY.ns += result->ns;
+    SUMMARY.allocBytes += result->allocBytes;
+    if(result->ns > SUMMARY.maxNs || SUMMARY.lines == 1) {
+        SUMMARY.maxNs = result->ns;
+        SUMMARY.maxNsLineNo = result->lineNo;
+    }
+    if(result->peakWidth > SUMMARY.maxPeakWidth) {
+        SUMMARY.maxPeakWidth = result->peakWidth;
+    }
+}
+
+void writeStatsSummary(FILE* stats) {
+    // The file-level summary is the last object in the file
+    fprintf(stats, "{\"summary\":true,\"lines\":%ld,\"classes\":{",
+        SUMMARY.lines);
+    for(int p = PATTERN_VANISHING; p <= PATTERN_OTHER; p++) {
+        fprintf(stats, "%s\"%s\":%ld", p == PATTERN_VANISHING ? "" : ",",
+            PATTERN_NAMES[p], SUMMARY.classes[p]);
+    }
+    fprintf(stats, "},\"rounds\":%ld,\"ns\":%llu,\"bytes\":%zu,"
+        "\"max_ns\":%llu,\"max_ns_line\":%ld,\"max_peak_width\":%d}\n",
+        SUMMARY.rounds, (unsigned long long)SUMMARY.ns, SUMMARY.allocBytes,
+        (unsigned long long)SUMMARY.maxNs, SUMMARY.maxNsLineNo,
+        SUMMARY.maxPeakWidth);
+}
+
+// The time series file starts with a schema header: the magic "BTSERIES",
+// a uint32 byte order mark 0x01020304 in the byte order of the data, the
+// number of columns, and for every column a 12 byte NUL padded name and a
+// 4 byte NUL padded type ("i64" or "i32"). Chunks follow until the end of
+// the file: a uint32 number of rows and then the values of every column
+// one column after another.
+#define SERIES_CHUNK_ROWS 65536
+#define SERIES_COLUMNS 5
+
+typedef struct SeriesChunk {
+    int rows;
+    int64_t line[SERIES_CHUNK_ROWS];
+    int32_t round[SERIES_CHUNK_ROWS];
+    int32_t population[SERIES_CHUNK_ROWS];
+    int32_t width[SERIES_CHUNK_ROWS];
+    int32_t left[SERIES_CHUNK_ROWS];
+} SeriesChunk;
+
+static SeriesChunk* SERIES_CHUNK;
+
+void writeSeriesHeader(FILE* out) {
+    static const char* names[SERIES_COLUMNS] = {
+        "line", "round", "population", "width", "left"
+    };
+    char column[16];
+    uint32_t header[2] = {0x01020304, SERIES_COLUMNS};
+    fwrite("BTSERIES", 1, 8, out);
+    fwrite(header, sizeof(uint32_t), 2, out);
+    for(int i = 0; i < SERIES_COLUMNS; i++) {
+        memset(column, 0, sizeof(column));
+        strncpy(column, names[i], 11);
+        strcpy(column + 12, i == 0 ? "i64" : "i32");
+        fwrite(column, 1, sizeof(column), out);
+    }
+}
+
+void flushSeriesChunk(FILE* out) {
+    SeriesChunk* chunk = SERIES_CHUNK;
+    if(chunk == NULL || chunk->rows == 0) {
+        return;
+    }
+    uint32_t rows = chunk->rows;
+    fwrite(&rows, sizeof(rows), 1, out);
+    fwrite(chunk->line, sizeof(int64_t), rows, out);
+    fwrite(chunk->round, sizeof(int32_t), rows, out);
+    fwrite(chunk->population, sizeof(int32_t), rows, out);
+    fwrite(chunk->width, sizeof(int32_t), rows, out);
+    fwrite(chunk->left, sizeof(int32_t), rows, out);
+    chunk->rows = 0;
+}
+
+void writeSeries(FILE* out, LineResult* result) {
+    // Append the series of the line to the current chunk. Called in the
+    // order of the input lines.
+    if(SERIES_CHUNK == NULL) {
+        SERIES_CHUNK = calloc(1, sizeof(SeriesChunk));
+        if(SERIES_CHUNK == NULL) {
+            printf("ERROR: memory allocation failed\n");
+            exit(1);
+        }
+        memAdd(MEM_QUEUES, sizeof(SeriesChunk));
+    }
+    SeriesChunk* chunk = SERIES_CHUNK;
+    for(int r = 0; r <= result->rounds; r++) {
+        if(chunk->rows == SERIES_CHUNK_ROWS) {
+            flushSeriesChunk(out);
+        }
+        TimePoint* point = &result->series[r];
+        chunk->line[chunk->rows] = result->lineNo;
+        chunk->round[chunk->rows] = r;
+        chunk->population[chunk->rows] = point->population;
+        chunk->width[chunk->rows] = point->width;
+        chunk->left[chunk->rows] = point->left;
+        chunk->rows++;
+    }
+    memSub(MEM_QUEUES, MAX_ROUNDS * sizeof(TimePoint));
+    free(result->series);
+    result->series = NULL;
+}
+
+// The index file starts with the magic "BTINDEX2", followed by 16 byte
+// records: the uint64 hash of a line and the uint64 (input line number << 8
+// | round). The records are written in the order of the input lines. When
+// the index is closed, they are sorted by hash and followed by a copy of
+// them sorted by input line and round, so that queries can use binary
+// search for both the lines reaching a hash and the hashes of a line.
+#define INDEX_MAGIC "BTINDEX2"
+#define INDEX_ROUND_BITS 8
+
+typedef struct IndexRecord {
+    uint64_t hash;
+    uint64_t key;
+} IndexRecord;
+
+void writeIndex(FILE* out, LineResult* result) {
+    for(int r = 0; r <= result->rounds; r++) {
+        IndexRecord record = {
+            result->hashes[r],
+            (uint64_t)result->lineNo << INDEX_ROUND_BITS | r
+        };
+        fwrite(&record, sizeof(record), 1, out);
+    }
+    memSub(MEM_QUEUES, MAX_ROUNDS * sizeof(uint64_t));
+    free(result->hashes);
+    result->hashes = NULL;
+}
+
+int compareIndexRecords(const void* a, const void* b) {
+    const IndexRecord* x = a;
+    const IndexRecord* y = b;
+    if(x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+int compareIndexKeys(const void* a, const void* b) {
+    const IndexRecord* x = a;
+    const IndexRecord* y = b;
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+IndexRecord* mapIndex(char* path, bool writable, size_t* count) {
+    // Map the records of the given index file in memory. Exit on errors.
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr,"ERROR: failed to open file: \"%s\"\n", path);
+        exit(1);
+    }
+    size_t header = strlen(INDEX_MAGIC);
+    char magic[8];
+    if((size_t)st.st_size < header ||
+       read(fd, magic, header) != (ssize_t)header ||
+       memcmp(magic, INDEX_MAGIC, header) != 0 ||
+       (st.st_size - header) % sizeof(IndexRecord) != 0) {
+        fprintf(stderr,"ERROR: not an index file: \"%s\"\n", path);
+        exit(1);
+    }
+    *count = (st.st_size - header) / sizeof(IndexRecord);
+    if(*count == 0) {
+        close(fd);
+        return NULL;
+    }
+    char* data = mmap(NULL, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0),
+        MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        fprintf(stderr, "ERROR: failed to map file: \"%s\": %s\n", path,
+            strerror(errno));
+        exit(1);
+    }
+    return (IndexRecord*)(data + header);
+}
+
+void unmapIndex(IndexRecord* records, size_t count) {
+    if(records != NULL) {
+        size_t header = strlen(INDEX_MAGIC);
+        munmap((char*)records - header, header + count * sizeof(IndexRecord));
+    }
+}
+
+void sortIndex(char* path) {
+    // Sort the records of the index file by hash and append a copy of them
+    // sorted by key. The file is sorted in place in a shared mapping, so
+    // corpora with more records than fit in memory are paged by the kernel.
+    int fd = open(path, O_RDWR);
+    struct stat st;
+    size_t header = strlen(INDEX_MAGIC);
+    if(fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < header ||
+       ftruncate(fd, 2 * st.st_size - header) != 0) {
+        fprintf(stderr, "ERROR: failed to sort index: \"%s\": %s\n", path,
+            strerror(errno));
+        exit(1);
+    }
+    close(fd);
+    size_t count;
+    IndexRecord* records = mapIndex(path, true, &count);
+    size_t half = count / 2;
+    if(half > 0) {
+        memcpy(records + half, records, half * sizeof(IndexRecord));
+        qsort(records, half, sizeof(IndexRecord), compareIndexRecords);
+        qsort(records + half, half, sizeof(IndexRecord), compareIndexKeys);
+    }
+    unmapIndex(records, count);
+}
+
+IndexRecord* mapSortedIndex(char* path, size_t* count) {
+    // Map a sorted index file. count is set to the number of records in
+    // each of the two sorted copies.
+    size_t total;
+    IndexRecord* records = mapIndex(path, false, &total);
+    if(total % 2 != 0) {
+        fprintf(stderr,"ERROR: not an index file: \"%s\"\n", path);
+        exit(1);
+    }
+    *count = total / 2;
+    return records;
+}
+
+size_t findHash(IndexRecord* records, size_t count, uint64_t hash) {
+    // Index of the first record with the given hash or a larger one
+    size_t lo = 0;
+    size_t hi = count;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(records[mid].hash < hash) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+size_t findKey(IndexRecord* records, size_t count, uint64_t key) {
+    // Index of the first record with the given key or a larger one in the
+    // records sorted by key
+    size_t lo = 0;
+    size_t hi = count;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(records[mid].key < key) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void queryRow(char* path, char* row) {
+    // Print the input lines and rounds that reach the given line, in the
+    // input format, at any position
+    size_t count;
+    IndexRecord* records = mapSortedIndex(path, &count);
+    char* begin = row + strspn(row, ".");
+    int len = strlen(begin);
+    while(len > 0 && begin[len-1] == EMPTY) {
+        len--;
+    }
+    for(int i = 0; i < len; i++) {
+        if(begin[i] != EMPTY && begin[i] != FILLED) {
+            fprintf(stderr, "ERROR: unexpected character: '%c'\n", begin[i]);
+            exit(1);
+        }
+        begin[i] = begin[i] == EMPTY ? ' ' : FILLED;
+    }
+    uint64_t hash = hashRow(begin, len);
+    printf("# line round\n");
+    for(size_t i = findHash(records, count, hash);
+        i < count && records[i].hash == hash; i++) {
+        printf("%llu %d\n",
+            (unsigned long long)(records[i].key >> INDEX_ROUND_BITS),
+            (int)(records[i].key & ((1 << INDEX_ROUND_BITS) - 1)));
+    }
+    unmapIndex(records, 2 * count);
+}
+
+typedef struct SharedLine {
+    uint64_t lineNo;
+    // Round of the other line and of the queried line of the first line
+    // they share
+    int round;
+    int queryRound;
+} SharedLine;
+
+int compareSharedLines(const void* a, const void* b) {
+    const SharedLine* x = a;
+    const SharedLine* y = b;
+    if(x->lineNo != y->lineNo) {
+        return x->lineNo < y->lineNo ? -1 : 1;
+    }
+    if(x->queryRound != y->queryRound) {
+        return x->queryRound - y->queryRound;
+    }
+    return x->round - y->round;
+}
+
+void queryLine(char* path, long lineNo) {
+    // Print the input lines that reach a line reached by the given input
+    // line. From that line on their histories are the same, apart from the
+    // position. Each input line is printed once, with the earliest round of
+    // the given line that it reaches.
+    size_t count;
+    IndexRecord* records = mapSortedIndex(path, &count);
+    // Hashes of the lines reached by the given line, found in the copy of
+    // the records sorted by key
+    IndexRecord* byKey = records + count;
+    uint64_t hashes[MAX_ROUNDS];
+    int rounds = 0;
+    for(size_t i = findKey(byKey, count, (uint64_t)lineNo << INDEX_ROUND_BITS);
+        i < count && byKey[i].key >> INDEX_ROUND_BITS == (uint64_t)lineNo;
+        i++) {
+        int r = byKey[i].key & ((1 << INDEX_ROUND_BITS) - 1);
+        hashes[r] = byKey[i].hash;
+        rounds = r + 1;
+    }
+    SharedLine* shared = NULL;
+    size_t numShared = 0;
+    size_t sharedSize = 0;
+    for(int r = 0; r < rounds; r++) {
+        for(size_t i = findHash(records, count, hashes[r]);
+            i < count && records[i].hash == hashes[r]; i++) {
+            uint64_t other = records[i].key >> INDEX_ROUND_BITS;
+            if(other == (uint64_t)lineNo) {
+                continue;
+            }
+            if(numShared == sharedSize) {
+                sharedSize = sharedSize > 0 ? 2 * sharedSize : 64;
+                shared = realloc(shared, sharedSize * sizeof(SharedLine));
+                if(shared == NULL) {
+                    printf("ERROR: memory allocation failed\n");
+                    exit(1);
+                }
+            }
+            shared[numShared].lineNo = other;
+            shared[numShared].round = 
+                records[i].key & ((1 << INDEX_ROUND_BITS) - 1);
+            shared[numShared].queryRound = r;
+            numShared++;
+        }
+    }
+    if(numShared > 0) {
+        qsort(shared, numShared, sizeof(SharedLine), compareSharedLines);
+    }
+    printf("# line round round-of-line-%ld\n", lineNo);
+    for(size_t i = 0; i < numShared; i++) {
+        if(i == 0 || shared[i].lineNo != shared[i-1].lineNo) {
+            printf("%llu %d %d\n", (unsigned long long)shared[i].lineNo,
+                shared[i].round, shared[i].queryRound);
+        }
+    }
+    free(shared);
+    unmapIndex(records, 2 * count);
+}
+
+// The binary output file starts with a BinaryHeader, followed by one
+// BinaryRecord for every input line: the result of line n is at offset
+// sizeof(BinaryHeader) + (n - 1) * sizeof(BinaryRecord). The file is sized
+// for all the input lines and mapped before the run, and the threads that
+// classify the lines write their results straight into it, in whatever
+// order they finish. The records of blank lines, of lines that are not
+// selected and of lines appended to the input after it was counted stay
+// zero, i.e. PATTERN_NONE.
+#define BINARY_MAGIC "BTRSLTS1"
+
+typedef struct BinaryHeader {
+    char magic[8];
+    uint32_t recordSize;
+    uint32_t maxRounds;
+    uint64_t lines;
+} BinaryHeader;
+
+struct BinaryRecord {
+    uint32_t width;
+    uint32_t peakWidth;
+    // Number of rounds played and the round of the earlier line the last
+    // line repeats, -1 if none, see LineResult
+    uint16_t rounds;
+    int16_t matchRound;
+    // Pattern recognized on the line
+    uint8_t pattern;
+    // Engine that filled the lines
+    uint8_t engine;
+};
+
+static size_t BINARY_SIZE;
+
+void openBinaryOutput(char* path, uint64_t lines) {
+    // Create the binary output file for the given number of input lines and
+    // map it in BINARY_RESULTS. The blocks of the file are allocated up
+    // front, so that the writes through the mapping can not run out of disk
+    // space halfway.
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0) {
+        fprintf(stderr,"ERROR: failed to open file: \"%s\"\n", path);
+        exit(1);
+    }
+    BINARY_SIZE = sizeof(BinaryHeader) + lines * sizeof(BinaryRecord);
+    int error = posix_fallocate(fd, 0, BINARY_SIZE);
+    if(error != 0) {
+        fprintf(stderr, "ERROR: failed to allocate file: \"%s\": %s\n",
+            path, strerror(error));
+        exit(1);
+    }
+    BinaryHeader* header = mmap(NULL, BINARY_SIZE, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    close(fd);
+    if(header == MAP_FAILED) {
+        fprintf(stderr, "ERROR: failed to map file: \"%s\": %s\n", path,
+            strerror(errno));
+        exit(1);
+    }
+    memcpy(header->magic, BINARY_MAGIC, sizeof(header->magic));
+    header->recordSize = sizeof(BinaryRecord);
+    header->maxRounds = MAX_ROUNDS;
+    header->lines = lines;
+    BINARY_RESULTS = (BinaryRecord*)(header + 1);
+}
+
+void writeBinaryResult(LineResult* result) {
+    BinaryHeader* header = (BinaryHeader*)BINARY_RESULTS - 1;
+    if((uint64_t)result->lineNo > header->lines) {
+        return;
+    }
+    BinaryRecord* record = &BINARY_RESULTS[result->lineNo - 1];
+    record->pattern = result->pattern;
+    record->rounds = result->rounds;
+    record->matchRound = result->matchRound;
+    record->engine = result->engine;
+    record->width = result->width;
+    record->peakWidth = result->peakWidth;
+}
+
+bool closeBinaryOutput(void) {
+    // Write the mapped results to disk and unmap them. Return false on
+    // errors.
+    BinaryHeader* header = (BinaryHeader*)BINARY_RESULTS - 1;
+    bool ok = msync(header, BINARY_SIZE, MS_SYNC) == 0;
+    munmap(header, BINARY_SIZE);
+    BINARY_RESULTS = NULL;
+    return ok;
+}
+
+void printResult(LineResult* result) {
+    if(BINARY_RESULTS == NULL) {
+        if(UNORDERED) {
+            fprintf(OUTPUT, "%ld ", result->lineNo);
+        }
+        fputs(PATTERN_NAMES[result->pattern], OUTPUT);
+        fputc('\n', OUTPUT);
+    }
+    if(STATS != NULL) {
+        writeStats(STATS, result);
+    }
+    if(result->series != NULL) {
+        writeSeries(TIMESERIES, result);
+    }
+    if(result->hashes != NULL) {
+        writeIndex(INDEX, result);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Checkpoints are written on CHECKPOINT_FILE, if not NULL, every
+// CHECKPOINT_LINES input lines. A checkpoint records the input offset and
+// line number of the first line not printed yet, and the offsets of the
+// output files at that point, after the files have been flushed to disk.
+// A resumed run truncates the output files to these offsets and continues
+// reading the input from the offset, so the files end up the same as the
+// files of an uninterrupted run.
+#define CHECKPOINT_VERSION 1
+
+// Output files covered by checkpoints
+typedef enum CheckpointFile {
+    CHECKPOINT_OUTPUT = 0,
+    CHECKPOINT_STATS,
+    CHECKPOINT_TIMESERIES,
+    CHECKPOINT_INDEX,
+    CHECKPOINT_FILES,
+} CheckpointFile;
+
+typedef struct Checkpoint {
+    long inputOffset;
+    long lineNo;
+    // Offsets of the output files, -1 if the file was not written
+    long offsets[CHECKPOINT_FILES];
+    StatsSummary summary;
+} Checkpoint;
+
+static char* CHECKPOINT_FILE;
+static long CHECKPOINT_LINES = 100000;
+
+// Line number of the last checkpoint
+static long CHECKPOINT_LINE;
+
+// Checkpoint the run was resumed from, lineNo is 0 if not resumed
+static Checkpoint RESUME;
+
+long syncFile(FILE* fp) {
+    // Flush the file to disk and return its offset, -1 if fp is NULL
+    if(fp == NULL) {
+        return -1;
+    }
+    if(fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        fprintf(stderr, "ERROR: failed to write output: %s\n",
+            strerror(errno));
+        exit(1);
+    }
+    return ftell(fp);
+}
+
+void writeCheckpoint(char* path, long inputOffset, long lineNo) {
+    // Write a checkpoint after the given input line on the given file. The
+    // checkpoint is written on a temporary file that is renamed over the
+    // last checkpoint, so that a crash never leaves half a checkpoint
+    // behind.
+    if(TIMESERIES != NULL) {
+        flushSeriesChunk(TIMESERIES);
+    }
+    FILE* files[CHECKPOINT_FILES] = {OUTPUT, STATS, TIMESERIES, INDEX};
+    long offsets[CHECKPOINT_FILES];
+    for(int i = 0; i < CHECKPOINT_FILES; i++) {
+        offsets[i] = syncFile(files[i]);
+    }
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* fp = fopen(tmp, "w");
+    if(fp == NULL) {
+        fprintf(stderr,"ERROR: failed to open file: \"%s\"\n", tmp);
+        exit(1);
+    }
+    fprintf(fp, "back-to-school checkpoint %d\n", CHECKPOINT_VERSION);
+    fprintf(fp, "input %ld %ld\n", inputOffset, lineNo);
+    fprintf(fp, "files");
+    for(int i = 0; i < CHECKPOINT_FILES; i++) {
+        fprintf(fp, " %ld", offsets[i]);
+    }
+    fprintf(fp, "\nsummary %ld", SUMMARY.lines);
+    for(int p = PATTERN_VANISHING; p <= PATTERN_OTHER; p++) {
+        fprintf(fp, " %ld", SUMMARY.classes[p]);
+    }
+    fprintf(fp, " %ld %llu %zu %llu %ld %d\n", SUMMARY.rounds,
+        (unsigned long long)SUMMARY.ns, SUMMARY.allocBytes,
+        (unsigned long long)SUMMARY.maxNs, SUMMARY.maxNsLineNo,
+        SUMMARY.maxPeakWidth);
+    if(syncFile(fp) < 0 || fclose(fp) != 0 || 
+       rename(tmp, path) != 0) {
+        fprintf(stderr, "ERROR: failed to write checkpoint: %s\n",
+            strerror(errno));
+        exit(1);
+    }
+    CHECKPOINT_LINE = lineNo;
+}
+
+void checkpointAfter(long inputOffset, long lineNo) {
+    // Write a checkpoint if CHECKPOINT_LINES lines have been printed since
+    // the last one
+    if(CHECKPOINT_FILE != NULL &&
+       lineNo - CHECKPOINT_LINE >= CHECKPOINT_LINES) {
+        writeCheckpoint(CHECKPOINT_FILE, inputOffset, lineNo);
+    }
+}
+
+bool readCheckpoint(char* path, Checkpoint* checkpoint) {
+    // Read the checkpoint from the given file. Return false if there is no
+    // checkpoint, exit if the file is not a valid checkpoint.
+    FILE* fp = fopen(path, "r");
+    if(fp == NULL) {
+        return false;
+    }
+    int version = 0;
+    StatsSummary* summary = &checkpoint->summary;
+    unsigned long long ns;
+    unsigned long long maxNs;
+    bool valid = fscanf(fp, "back-to-school checkpoint %d", &version) == 1 &&
+        version == CHECKPOINT_VERSION &&
+        fscanf(fp, " input %ld %ld", &checkpoint->inputOffset,
+            &checkpoint->lineNo) == 2 &&
+        fscanf(fp, " files") == 0;
+    for(int i = 0; i < CHECKPOINT_FILES && valid; i++) {
+        valid = fscanf(fp, "%ld", &checkpoint->offsets[i]) == 1;
+    }
+    valid = valid && fscanf(fp, " summary %ld", &summary->lines) == 1;
+    for(int p = PATTERN_VANISHING; p <= PATTERN_OTHER && valid; p++) {
+        valid = fscanf(fp, "%ld", &summary->classes[p]) == 1;
+    }
+    valid = valid && fscanf(fp, "%ld %llu %zu %llu %ld %d", &summary->rounds,
+        &ns, &summary->allocBytes, &maxNs, &summary->maxNsLineNo,
+        &summary->maxPeakWidth) == 6;
+    fclose(fp);
+    if(!valid) {
+        fprintf(stderr, "ERROR: invalid checkpoint: \"%s\"\n", path);
+        exit(1);
+    }
+    summary->ns = ns;
+    summary->maxNs = maxNs;
+    return true;
+}
+
+FILE* openOutputFile(char* path, const char* mode, CheckpointFile file) {
+    // Open an output file. When resuming, the file written by the earlier
+    // run is opened and truncated to its offset in the checkpoint instead.
+    // Return NULL on errors.
+    if(RESUME.lineNo == 0) {
+        return fopen(path, mode);
+    }
+    if(RESUME.offsets[file] < 0) {
+        fprintf(stderr, "ERROR: \"%s\" was not written before the "
+            "checkpoint\n", path);
+        return NULL;
+    }
+    FILE* fp = fopen(path, "r+");
+    if(fp == NULL || ftruncate(fileno(fp), RESUME.offsets[file]) != 0 ||
+       fseek(fp, 0, SEEK_END) != 0) {
+        return NULL;
+    }
+    return fp;
+}
+
+long resumeInput(FILE* fp) {
+    // Skip the lines printed before the checkpoint the run is resumed from,
+    // if any. Return the number of lines skipped.
+    if(RESUME.lineNo > 0 && fseek(fp, RESUME.inputOffset, SEEK_SET) != 0) {
+        fprintf(stderr, "ERROR: failed to resume input: %s\n",
+            strerror(errno));
+        exit(1);
+    }
+    CHECKPOINT_LINE = RESUME.lineNo;
+    return RESUME.lineNo;
+}
+
+ssize_t readLine(char** line, size_t* len, FILE* fp) {
+    // getline with the line buffer accounted in MEM_ROW_BUFFERS
+    size_t before = *len;
+    ssize_t read = getline(line, len, fp);
+    if(*len != before) {
+        memSub(MEM_ROW_BUFFERS, before);
+        memAdd(MEM_ROW_BUFFERS, *len);
+    }
+    return read;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// With --line or --lines only the selected input lines are classified. The
+// reader seeks straight to the first selected line with a line index: a
+// sidecar file with the offset of every LINE_INDEX_STEP'th input line. The
+// index is built by a parallel scan for newlines the first time it is
+// needed, and again whenever the input has changed. The index file starts
+// with the magic "BTLINES1", followed by the uint64 step, number of lines,
+// input size and input modification time in seconds and nanoseconds, and
+// the uint64 offsets of lines 1, 1 + step, 1 + 2 * step, ...
+#define LINE_INDEX_MAGIC "BTLINES1"
+#define LINE_INDEX_STEP 1024
+
+// Smallest chunk of the input scanned by a thread
+#define LINE_SCAN_CHUNK (1 << 20)
+
+typedef struct LineIndex {
+    char magic[8];
+    uint64_t step;
+    uint64_t lines;
+    uint64_t size;
+    uint64_t mtimeSec;
+    uint64_t mtimeNsec;
+    // Followed by the offsets
+} LineIndex;
+
+// First and last selected input line, LINE_FIRST is 0 if all the lines are
+// classified
+static long LINE_FIRST;
+static long LINE_LAST = LONG_MAX;
+
+// Input offset of LINE_FIRST
+static long LINE_FIRST_OFFSET;
+
+// Number of input lines, only counted if needed
+static uint64_t INPUT_LINES;
+
+typedef struct LineScan {
+    pthread_t thread;
+    const char* data;
+    size_t begin;
+    size_t end;
+    // Newlines before the chunk and in the chunk
+    uint64_t before;
+    uint64_t count;
+    // Offsets of the sampled lines, NULL while counting the newlines
+    uint64_t* offsets;
+    uint64_t samples;
+} LineScan;
+
+uint64_t* lineOffsets(LineIndex* index) {
+    return (uint64_t*)(index + 1);
+}
+
+size_t lineIndexSize(uint64_t lines, uint64_t step) {
+    uint64_t samples = lines > 0 ? (lines - 1) / step + 1 : 0;
+    return sizeof(LineIndex) + samples * sizeof(uint64_t);
+}
+
+void* scanNewlines(void* arg) {
+    // Count the newlines of a chunk of the input or, once the newlines
+    // before the chunk are known, record the offsets of the sampled lines
+    // that start in the chunk
+    LineScan* scan = arg;
+    uint64_t n = scan->before;
+    const char* p = scan->data + scan->begin;
+    const char* end = scan->data + scan->end;
+    while(p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+        // Line n + 1 starts after newline n
+        n++;
+        p++;
+        if(scan->offsets != NULL && n % LINE_INDEX_STEP == 0 &&
+           n / LINE_INDEX_STEP < scan->samples) {
+            scan->offsets[n / LINE_INDEX_STEP] = p - scan->data;
+        }
+    }
+    scan->count = n - scan->before;
+    return NULL;
+}
+
+void runLineScans(LineScan* scans, int count) {
+    for(int i = 1; i < count; i++) {
+        if(pthread_create(&scans[i].thread, NULL, scanNewlines,
+                          &scans[i]) != 0) {
+            fprintf(stderr, "ERROR: failed to create a thread\n");
+            exit(1);
+        }
+    }
+    scanNewlines(&scans[0]);
+    for(int i = 1; i < count; i++) {
+        pthread_join(scans[i].thread, NULL);
+    }
+}
+
+LineIndex* buildLineIndex(const char* data, struct stat* st) {
+    // Build the line index of the mapped input. The input is split in one
+    // chunk per CPU. The newlines of every chunk are counted first, and the
+    // offsets of the sampled lines are recorded in a second pass once the
+    // number of the first line of every chunk is known.
+    size_t size = st->st_size;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1 || size / LINE_SCAN_CHUNK < (size_t)threads) {
+        threads = size / LINE_SCAN_CHUNK + 1;
+    }
+    LineScan* scans = calloc(threads, sizeof(LineScan));
+    if(scans == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    for(int i = 0; i < threads; i++) {
+        scans[i].data = data;
+        scans[i].begin = size * i / threads;
+        scans[i].end = size * (i + 1) / threads;
+    }
+    runLineScans(scans, threads);
+    uint64_t newlines = 0;
+    for(int i = 0; i < threads; i++) {
+        scans[i].before = newlines;
+        newlines += scans[i].count;
+    }
+    uint64_t lines = newlines + (size > 0 && data[size-1] != '\n');
+    LineIndex* index = malloc(lineIndexSize(lines, LINE_INDEX_STEP));
+    if(index == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(index->magic, LINE_INDEX_MAGIC, sizeof(index->magic));
+    index->step = LINE_INDEX_STEP;
+    index->lines = lines;
+    index->size = size;
+    index->mtimeSec = st->st_mtim.tv_sec;
+    index->mtimeNsec = st->st_mtim.tv_nsec;
+    uint64_t samples = (lineIndexSize(lines, LINE_INDEX_STEP) -
+        sizeof(LineIndex)) / sizeof(uint64_t);
+    if(samples > 0) {
+        lineOffsets(index)[0] = 0;
+    }
+    for(int i = 0; i < threads; i++) {
+        scans[i].offsets = lineOffsets(index);
+        scans[i].samples = samples;
+    }
+    runLineScans(scans, threads);
+    free(scans);
+    return index;
+}
+
+LineIndex* mapLineIndex(char* path, struct stat* st) {
+    // Map the line index on the given file. Return NULL if there is no
+    // index or if it does not match the input with the given status.
+    int fd = open(path, O_RDONLY);
+    struct stat indexSt;
+    if(fd < 0) {
+        return NULL;
+    }
+    if(fstat(fd, &indexSt) != 0 || 
+       (size_t)indexSt.st_size < sizeof(LineIndex)) {
+        close(fd);
+        return NULL;
+    }
+    LineIndex* index = mmap(NULL, indexSt.st_size, PROT_READ, MAP_SHARED,
+        fd, 0);
+    close(fd);
+    if(index == MAP_FAILED) {
+        return NULL;
+    }
+    if(memcmp(index->magic, LINE_INDEX_MAGIC, sizeof(index->magic)) != 0 ||
+       index->step == 0 ||
+       lineIndexSize(index->lines, index->step) != (size_t)indexSt.st_size ||
+       index->size != (uint64_t)st->st_size ||
+       index->mtimeSec != (uint64_t)st->st_mtim.tv_sec ||
+       index->mtimeNsec != (uint64_t)st->st_mtim.tv_nsec) {
+        munmap(index, indexSt.st_size);
+        return NULL;
+    }
+    return index;
+}
+
+bool writeLineIndex(char* path, LineIndex* index) {
+    // Write the index on a temporary file that is renamed over the old
+    // index. Return false on errors.
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* fp = fopen(tmp, "wb");
+    if(fp == NULL) {
+        return false;
+    }
+    size_t size = lineIndexSize(index->lines, index->step);
+    bool ok = fwrite(index, size, 1, fp) == 1;
+    ok = fclose(fp) == 0 && ok;
+    if(!ok || rename(tmp, path) != 0) {
+        remove(tmp);
+        return false;
+    }
+    return true;
+}
+
+void indexInput(char* textfile, char* indexFile) {
+    // Count the input lines in INPUT_LINES and find the input offset of
+    // LINE_FIRST, if not 0, with the line index on indexFile, or on
+    // <textfile>.lines if NULL. The index is built if it is missing or out
+    // of date. The offset of the closest sampled line before LINE_FIRST is
+    // looked up in the index, and the rest of the way is found in the mapped
+    // input.
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.lines", textfile);
+    if(indexFile == NULL) {
+        indexFile = path;
+    }
+    int fd = open(textfile, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr,"ERROR: failed to open file: \"%s\"\n", textfile);
+        exit(1);
+    }
+    if(!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "ERROR: the input must be a regular file: \"%s\"\n",
+            textfile);
+        exit(1);
+    }
+    char* data = NULL;
+    if(st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(data == MAP_FAILED) {
+            fprintf(stderr, "ERROR: failed to map file: \"%s\": %s\n",
+                textfile, strerror(errno));
+            exit(1);
+        }
+    }
+    close(fd);
+    LineIndex* index = mapLineIndex(indexFile, &st);
+    bool mapped = index != NULL;
+    if(!mapped) {
+        index = buildLineIndex(data, &st);
+        if(!writeLineIndex(indexFile, index)) {
+            fprintf(stderr, "WARNING: failed to write the line index: "
+                "\"%s\": %s\n", indexFile, strerror(errno));
+        }
+    }
+    INPUT_LINES = index->lines;
+    if((uint64_t)LINE_FIRST > index->lines) {
+        fprintf(stderr, "ERROR: the input has only %llu lines\n",
+            (unsigned long long)index->lines);
+        exit(1);
+    }
+    if(LINE_FIRST != 0) {
+        uint64_t sample = (LINE_FIRST - 1) / index->step;
+        uint64_t offset = lineOffsets(index)[sample];
+        for(uint64_t n = sample * index->step + 1; n < (uint64_t)LINE_FIRST;
+            n++) {
+            char* newline = memchr(data + offset, '\n', st.st_size - offset);
+            offset = newline - data + 1;
+        }
+        LINE_FIRST_OFFSET = offset;
+    }
+    if(mapped) {
+        munmap(index, lineIndexSize(index->lines, index->step));
+    }
+    else {
+        free(index);
+    }
+    if(data != NULL) {
+        munmap(data, st.st_size);
+    }
+}
+
+long startInput(FILE* fp) {
+    // Seek to the first line to classify: the first line after the
+    // checkpoint the run is resumed from, or the first selected line.
+    // Return the number of lines before it.
+    if(LINE_FIRST == 0) {
+        return resumeInput(fp);
+    }
+    if(fseek(fp, LINE_FIRST_OFFSET, SEEK_SET) != 0) {
+        fprintf(stderr, "ERROR: failed to seek the input: %s\n",
+            strerror(errno));
+        exit(1);
+    }
+    return LINE_FIRST - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// In follow mode the input is read to its end, and then the program waits
+// for lines to be appended to it, like tail -f, until it is interrupted or
+// the file is removed. Only complete lines are classified: a line without a
+// newline at the end of the file is read again once the rest of it has been
+// appended. The program wakes up on inotify events on the file, and also
+// checks the file once a second in case the events are not delivered (e.g.
+// on network file systems).
+static bool FOLLOW;
+static int FOLLOW_INOTIFY = -1;
+static volatile sig_atomic_t FOLLOW_STOP;
+
+// Size of the input when it was last read to its end
+static off_t FOLLOW_SIZE = -1;
+
+// readCompleteLine return value when the end of the input has been reached
+// in follow mode
+#define LINE_PENDING -2
+
+void handleFollowStop(int sig) {
+    (void)sig;
+    FOLLOW_STOP = 1;
+}
+
+void startFollowing(char* textfile) {
+    // Watch the input file and stop following, instead of exiting, on
+    // SIGINT and SIGTERM so that the reports are still written
+    FOLLOW_INOTIFY = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if(FOLLOW_INOTIFY < 0 || inotify_add_watch(FOLLOW_INOTIFY, textfile,
+           IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        fprintf(stderr, "WARNING: inotify is not available, checking the "
+            "input once a second: %s\n", strerror(errno));
+    }
+    struct sigaction action = {0};
+    action.sa_handler = handleFollowStop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+ssize_t readCompleteLine(char** line, size_t* len, FILE* fp) {
+    // readLine, but in follow mode return LINE_PENDING at the end of the
+    // input instead of -1, and leave an incomplete last line unread
+    ssize_t read = readLine(line, len, fp);
+    if(FOLLOW && read == -1) {
+        clearerr(fp);
+        return LINE_PENDING;
+    }
+    if(FOLLOW && read > 0 && (*line)[read-1] != '\n') {
+        fseek(fp, -read, SEEK_CUR);
+        return LINE_PENDING;
+    }
+    return read;
+}
+
+bool followInput(FILE* fp, long lineNo) {
+    // Called when all the complete lines of the input have been printed.
+    // Make the results visible, checkpoint and wait for the input to grow.
+    // Return false if following should stop.
+    fflush(OUTPUT);
+    if(CHECKPOINT_FILE != NULL && lineNo > CHECKPOINT_LINE) {
+        writeCheckpoint(CHECKPOINT_FILE, ftell(fp), lineNo);
+    }
+    while(!FOLLOW_STOP) {
+        // SIGUSR1 interrupts poll, so the snapshot is written right away
+        checkLatencySnapshot();
+        struct stat st;
+        if(fstat(fileno(fp), &st) != 0 || st.st_nlink == 0) {
+            // Removed
+            return false;
+        }
+        long offset = ftell(fp);
+        if(st.st_size < offset) {
+            fprintf(stderr, "ERROR: input file was truncated\n");
+            return false;
+        }
+        // A pending incomplete line is only read again when the file grows
+        if(st.st_size > offset && st.st_size != FOLLOW_SIZE) {
+            FOLLOW_SIZE = st.st_size;
+            return true;
+        }
+        struct pollfd pfd = {FOLLOW_INOTIFY, POLLIN, 0};
+        if(poll(&pfd, 1, 1000) > 0) {
+            // Drain the events, the file is checked above
+            char events[4096];
+            while(read(FOLLOW_INOTIFY, events, sizeof(events)) > 0) {
+            }
+        }
+    }
+    return false;
+}
+
+void freeLine(char* line, size_t len) {
+    memSub(MEM_ROW_BUFFERS, len);
+    free(line);
+}
+
+void play(char* textfile) {
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    FILE *fp = openInput(textfile);
+    long lineNo = startInput(fp);
+    Histograms* hist = LATENCY != NULL ? newHistograms() : NULL;
+    PERF = PERF_REPORT != NULL ? openPerfCounters() : NULL;
+    TRACE = TRACE_FILE != NULL ? newTraceBuffer("main") : NULL;
+
+    while(lineNo < LINE_LAST) {
+        uint64_t start = traceBegin();
+        if((read = readCompleteLine(&line, &len, fp)) == -1) {
+            break;
+        }
+        if(read == LINE_PENDING) {
+            if(!followInput(fp, lineNo)) {
+                break;
+            }
+            continue;
+        }
+        lineNo++;
+        traceEnd("read", start, lineNo, PATTERN_NONE);
+        char unexpected;
+        start = traceBegin();
+        LineStatus status = prepareLine(line, &read, &unexpected);
+        traceEnd("parse", start, lineNo, PATTERN_NONE);
+        if(status == LINE_BLANK) {
+            continue;
+        }
+        if(status != LINE_OK) {
+            exitOnLineError(status, unexpected);
+        }
+        LineResult result;
+        result.lineNo = lineNo;
+        classifyLine(line, &result);
+        if(BINARY_RESULTS != NULL) {
+            writeBinaryResult(&result);
+        }
+        if(hist != NULL) {
+            recordLatency(hist, &result);
+        }
+        printResult(&result);
+        checkLatencySnapshot();
+        checkpointAfter(ftell(fp), lineNo);
+    }
+    uint64_t start = traceBegin();
+    fflush(OUTPUT);
+    traceEnd("flush", start, 0, PATTERN_NONE);
+    flushHotCounters();
+    closePerfCounters();
+
+    fclose(fp);
+    freeLine(line, len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The worker threads take the batches from a priority queue. When the
+// results are printed in input order, the oldest batch goes first, since a
+// younger batch can not be printed before it anyway. With --unordered the
+// results are printed as soon as their batch is done, and the batches are
+// scheduled shortest job first with aging: a batch is keyed by the time it
+// was queued plus the estimated cost of its average line, so narrow lines
+// overtake wide ones queued a little earlier but every batch eventually gets
+// its turn. Lines wider than HEAVY_WIDTH are the bulk class: they are put in
+// batches of one line, whose cost counts BULK_STRETCH times, so that they do
+// not hold up the narrow lines read with them.
+static int HEAVY_WIDTH = 1024;
+#define BULK_STRETCH 16
+
+// Rough time to fill one square of a line, for the cost estimates
+#define SQUARE_NS 1
+
+typedef struct Batch {
+    // Sequence number of the batch in the input
+    long seq;
+    // Lines of the batch, stored one after another in text
+    int count;
+    size_t offsets[BATCH_LINES];
+    ssize_t lengths[BATCH_LINES];
+    long lineNos[BATCH_LINES];
+    char* text;
+    size_t textLen;
+    size_t textSize;
+    LineResult results[BATCH_LINES];
+    // Input offset and line number after the batch, for checkpoints. The
+    // offset is -1 if the batch ends in an invalid line.
+    long inputEnd;
+    long lineNoEnd;
+    // Estimated time to classify the lines, whether they are wider than
+    // HEAVY_WIDTH and the key of the batch in the work queue
+    uint64_t cost;
+    bool heavy;
+    uint64_t key;
+    // Set by the worker thread once all the lines have been classified
+    bool done;
+    // Set once the results have been printed
+    bool printed;
+} Batch;
+
+typedef struct Worker {
+    pthread_t thread;
+    struct Pool* pool;
+    // Latency histograms of the thread, NULL if not recorded
+    Histograms* hist;
+    // Time spent classifying lines
+    uint64_t simNs;
+    // Time spent waiting for batches to classify
+    uint64_t waitNs;
+} Worker;
+
+typedef struct PoolStats {
+    // Wall time of the whole run
+    uint64_t wallNs;
+    // Sums over the worker threads
+    uint64_t simNs;
+    uint64_t waitNs;
+    // Main thread: reading and validating the input
+    uint64_t readNs;
+    // Main thread: waiting for the oldest batch in the reorder window
+    uint64_t stallNs;
+    // Main thread: printing results
+    uint64_t outputNs;
+    long lines;
+} PoolStats;
+
+typedef struct Pool {
+    pthread_mutex_t lock;
+    pthread_cond_t workAvailable;
+    pthread_cond_t batchDone;
+    pthread_cond_t memoryAvailable;
+    // History bytes reserved by the lines being classified, when running
+    // with a memory budget
+    size_t reserved;
+    // Batches waiting for a worker thread, a binary heap on Batch.key
+    Batch** queue;
+    int queued;
+    // Reorder window: batch with sequence number seq is batches[seq % size],
+    // or out of order (see reorderResults) any batch that has been printed
+    // is reused
+    Batch* batches;
+    int numBatches;
+    // Sequence number of the next batch to read and the number of batches
+    // printed, which is the sequence number of the next one to print in
+    // input order
+    long nextSeq;
+    long nextOut;
+    bool closing;
+    Worker* workers;
+    int numWorkers;
+} Pool;
+
+size_t reserveHistory(Pool* pool, size_t width) {
+    // With a memory budget, wait until the history of a line of the given
+    // width fits in the budget next to the lines being classified by the
+    // other threads. A line is always let through if no other line is being
+    // classified, even if it alone exceeds the budget. Return the number of
+    // bytes reserved.
+    //
+    // The quarter of the budget given to the batches is set aside whether
+    // the batches use it or not, and the instrumentation is not part of the
+    // budget at all, so that tracing or statistics do not change how many
+    // lines are played at the same time.
+    size_t estimate = historyEstimate(width);
+    pthread_mutex_lock(&pool->lock);
+    while(pool->reserved > 0) {
+        size_t other = MEMORY_BUDGET / 4 + memCurrent(MEM_ROW_BUFFERS) +
+            memCurrent(MEM_CACHES);
+        size_t available = MEMORY_BUDGET > other ? MEMORY_BUDGET - other : 0;
+        if(pool->reserved + estimate <= available) {
+            break;
+        }
+        pthread_cond_wait(&pool->memoryAvailable, &pool->lock);
+    }
+    pool->reserved += estimate;
+    pthread_mutex_unlock(&pool->lock);
+    return estimate;
+}
+
+void releaseHistory(Pool* pool, size_t estimate) {
+    pthread_mutex_lock(&pool->lock);
+    pool->reserved -= estimate;
+    pthread_cond_broadcast(&pool->memoryAvailable);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pushBatch(Pool* pool, Batch* batch) {
+    // Add the batch to the work queue. The lock must be held.
+    int i = pool->queued++;
+    while(i > 0 && pool->queue[(i-1)/2]->key > batch->key) {
+        pool->queue[i] = pool->queue[(i-1)/2];
+        i = (i-1)/2;
+    }
+    pool->queue[i] = batch;
+}
+
+Batch* popBatch(Pool* pool) {
+    // Take the batch with the smallest key from the work queue, NULL if it
+    // is empty. The lock must be held.
+    if(pool->queued == 0) {
+        return NULL;
+    }
+    Batch* first = pool->queue[0];
+    Batch* last = pool->queue[--pool->queued];
+    int i = 0;
+    while(2*i + 1 < pool->queued) {
+        int child = 2*i + 1;
+        if(child + 1 < pool->queued &&
+           pool->queue[child+1]->key < pool->queue[child]->key) {
+            child++;
+        }
+        if(pool->queue[child]->key >= last->key) {
+            break;
+        }
+        pool->queue[i] = pool->queue[child];
+        i = child;
+    }
+    pool->queue[i] = last;
+    return first;
+}
+
+void* workerMain(void* arg) {
+    Worker* worker = arg;
+    Pool* pool = worker->pool;
+    PERF = PERF_REPORT != NULL ? openPerfCounters() : NULL;
+    TRACE = TRACE_FILE != NULL ? newTraceBuffer("worker") : NULL;
+    while(true) {
+        uint64_t start = nowNs();
+        pthread_mutex_lock(&pool->lock);
+        while(pool->queued == 0 && !pool->closing) {
+            pthread_cond_wait(&pool->workAvailable, &pool->lock);
+        }
+        Batch* batch = popBatch(pool);
+        pthread_mutex_unlock(&pool->lock);
+        worker->waitNs += nowNs() - start;
+        if(batch == NULL) {
+            flushHotCounters();
+            closePerfCounters();
+            return NULL;
+        }
+
+        start = nowNs();
+        for(int i = 0; i < batch->count; i++) {
+            size_t estimate = MEMORY_BUDGET != 0 ? 
+                reserveHistory(pool, batch->lengths[i]) : 0;
+            batch->results[i].lineNo = batch->lineNos[i];
+            classifyLine(batch->text + batch->offsets[i], &batch->results[i]);
+            if(BINARY_RESULTS != NULL) {
+                writeBinaryResult(&batch->results[i]);
+            }
+            if(worker->hist != NULL) {
+                recordLatency(worker->hist, &batch->results[i]);
+            }
+            if(estimate != 0) {
+                releaseHistory(pool, estimate);
+            }
+        }
+        worker->simNs += nowNs() - start;
+
+        pthread_mutex_lock(&pool->lock);
+        batch->done = true;
+        pthread_cond_signal(&pool->batchDone);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void appendLine(Batch* batch, char* line, ssize_t len, long lineNo) {
+    // Copy the raw input line at the end of the batch
+    if(batch->textLen + len + 1 > batch->textSize) {
+        size_t size = 2 * (batch->textLen + len + 1);
+        batch->text = realloc(batch->text, size);
+        if(batch->text == NULL) {
+            printf("ERROR: memory allocation failed\n");
+            exit(1);
+        }
+        memAdd(MEM_QUEUES, size - batch->textSize);
+        batch->textSize = size;
+    }
+    batch->lineNos[batch->count] = lineNo;
+    batch->lengths[batch->count] = len;
+    batch->cost += (uint64_t)(len + 32) * MAX_ROUNDS * SQUARE_NS;
+    batch->heavy = len > HEAVY_WIDTH;
+    batch->offsets[batch->count++] = batch->textLen;
+    memcpy(batch->text + batch->textLen, line, len + 1);
+    batch->textLen += len + 1;
+}
+
+LineStatus parseBatch(Batch* batch, char* unexpected) {
+    // Validate the raw lines of the batch with prepareLine and drop the
+    // blank lines. On an invalid line, the batch is cut right before it.
+    int kept = 0;
+    for(int i = 0; i < batch->count; i++) {
+        LineStatus status = prepareLine(batch->text + batch->offsets[i],
+            &batch->lengths[i], unexpected);
+        if(status == LINE_BLANK) {
+            continue;
+        }
+        if(status != LINE_OK) {
+            batch->count = kept;
+            return status;
+        }
+        batch->offsets[kept] = batch->offsets[i];
+        batch->lengths[kept] = batch->lengths[i];
+        batch->lineNos[kept] = batch->lineNos[i];
+        kept++;
+    }
+    batch->count = kept;
+    return LINE_OK;
+}
+
+bool reorderResults(void) {
+    // The results are printed in input order unless --unordered, or unless
+    // they are written on the binary output where every line has its own
+    // place
+    return !UNORDERED && BINARY_RESULTS == NULL;
+}
+
+Batch* doneBatch(Pool* pool) {
+    // The batch to print next: the oldest batch in the reorder window if it
+    // is done, or out of order any batch that is done and not printed yet.
+    // NULL if there is none. The lock must be held.
+    if(reorderResults()) {
+        Batch* batch = &pool->batches[pool->nextOut % pool->numBatches];
+        return batch->done && !batch->printed ? batch : NULL;
+    }
+    for(int i = 0; i < pool->numBatches; i++) {
+        Batch* batch = &pool->batches[i];
+        if(batch->done && !batch->printed) {
+            return batch;
+        }
+    }
+    return NULL;
+}
+
+bool printNextBatch(Pool* pool, bool wait, PoolStats* stats) {
+    // Print the results of the next batch (see doneBatch) if there is one.
+    // If wait is true, wait for one to be done first. Return true if a batch
+    // was printed.
+    if(pool->nextOut == pool->nextSeq) {
+        return false;
+    }
+    uint64_t start = nowNs();
+    pthread_mutex_lock(&pool->lock);
+    Batch* batch;
+    while((batch = doneBatch(pool)) == NULL && wait) {
+        pthread_cond_wait(&pool->batchDone, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    stats->stallNs += nowNs() - start;
+    if(batch == NULL) {
+        return false;
+    }
+    start = nowNs();
+    uint64_t traceStart = traceBegin();
+    for(int i = 0; i < batch->count; i++) {
+        printResult(&batch->results[i]);
+    }
+    traceEnd("output", traceStart, 0, PATTERN_NONE);
+    stats->lines += batch->count;
+    stats->outputNs += nowNs() - start;
+    batch->printed = true;
+    pool->nextOut++;
+    if(batch->inputEnd >= 0) {
+        checkpointAfter(batch->inputEnd, batch->lineNoEnd);
+    }
+    // Give the text buffer back instead of reusing it if the queues take
+    // more than their share of the memory budget
+    if(MEMORY_BUDGET != 0 && memCurrent(MEM_QUEUES) > MEMORY_BUDGET / 4) {
+        memSub(MEM_QUEUES, batch->textSize);
+        free(batch->text);
+        batch->text = NULL;
+        batch->textSize = 0;
+    }
+    return true;
+}
+
+Batch* freeBatch(Pool* pool) {
+    // The batch to read the next lines in: the next one in the reorder
+    // window, or out of order any batch that has been printed. There must be
+    // one.
+    if(reorderResults()) {
+        return &pool->batches[pool->nextSeq % pool->numBatches];
+    }
+    for(int i = 0; i < pool->numBatches; i++) {
+        if(pool->batches[i].printed) {
+            return &pool->batches[i];
+        }
+    }
+    fprintf(stderr, "ERROR: no free batch in the reorder window\n");
+    exit(1);
+}
+
+void submitBatch(Pool* pool, Batch* batch) {
+    if(UNORDERED) {
+        batch->key = nowNs() + batch->cost / batch->count *
+            (batch->heavy ? BULK_STRETCH : 1);
+    }
+    else {
+        batch->key = batch->seq;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pushBatch(pool, batch);
+    pthread_cond_signal(&pool->workAvailable);
+    pthread_mutex_unlock(&pool->lock);
+    pool->nextSeq++;
+}
+
+void playParallel(char* textfile, int jobs, PoolStats* stats) {
+    // Like play, but the lines are classified by jobs worker threads. The
+    // main thread reads the input in batches and prints the results in the
+    // input order.
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t read = 0;
+    FILE *fp = openInput(textfile);
+    long lineNo = startInput(fp);
+    uint64_t startWall = nowNs();
+    TRACE = TRACE_FILE != NULL ? newTraceBuffer("main") : NULL;
+
+    Pool pool = {0};
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.workAvailable, NULL);
+    pthread_cond_init(&pool.batchDone, NULL);
+    pthread_cond_init(&pool.memoryAvailable, NULL);
+    pool.numBatches = jobs * BATCHES_PER_WORKER;
+    // With a memory budget, a quarter of it is given to the batches in
+    // flight and the rest to the games being played. A batch takes its
+    // fixed part and at most twice its text, which may end in a line of
+    // MAX_LINE_LEN characters, see appendLine. Fewer batches are kept in
+    // flight if they would not fit otherwise.
+    size_t batchBytes = BATCH_BYTES;
+    if(MEMORY_BUDGET != 0) {
+        size_t fixed = sizeof(Batch) + sizeof(Batch*);
+        size_t lineBytes = 2 * (MAX_LINE_LEN + 2);
+        size_t smallest = fixed + lineBytes + 2 * BATCH_LINES;
+        if(MEMORY_BUDGET / 4 / pool.numBatches < smallest) {
+            pool.numBatches = MEMORY_BUDGET / 4 / smallest;
+            if(pool.numBatches < 1) {
+                pool.numBatches = 1;
+            }
+        }
+        size_t share = MEMORY_BUDGET / 4 / pool.numBatches;
+        size_t text = share > fixed + lineBytes ?
+            (share - fixed - lineBytes) / 2 : 1;
+        if(text < batchBytes) {
+            batchBytes = text > 0 ? text : 1;
+        }
+    }
+    pool.batches = calloc(pool.numBatches, sizeof(Batch));
+    pool.numWorkers = jobs;
+    pool.workers = calloc(jobs, sizeof(Worker));
+    pool.queue = calloc(pool.numBatches, sizeof(Batch*));
+    if(pool.batches == NULL || pool.workers == NULL || pool.queue == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    memAdd(MEM_QUEUES, pool.numBatches * (sizeof(Batch) + sizeof(Batch*)));
+    for(int i = 0; i < pool.numBatches; i++) {
+        pool.batches[i].printed = true;
+    }
+    for(int i = 0; i < jobs; i++) {
+        pool.workers[i].pool = &pool;
+        pool.workers[i].hist = LATENCY != NULL ? newHistograms() : NULL;
+        if(pthread_create(&pool.workers[i].thread, NULL, workerMain,
+                          &pool.workers[i]) != 0) {
+            fprintf(stderr, "ERROR: failed to create a thread\n");
+            exit(1);
+        }
+    }
+
+    LineStatus status = LINE_OK;
+    char unexpected = 0;
+    // Set if the last line read is left for the next batch
+    bool carry = false;
+    while(status == LINE_OK && read != -1) {
+        // Make room in the reorder window for the next batch
+        while(pool.nextSeq - pool.nextOut == pool.numBatches ||
+              (MEMORY_BUDGET != 0 && pool.nextSeq > pool.nextOut &&
+               memCurrent(MEM_QUEUES) > MEMORY_BUDGET / 4)) {
+            printNextBatch(&pool, true, stats);
+        }
+        Batch* batch = freeBatch(&pool);
+        batch->seq = pool.nextSeq;
+        batch->count = 0;
+        batch->textLen = 0;
+        batch->cost = 0;
+        batch->done = false;
+        batch->printed = false;
+
+        uint64_t start = nowNs();
+        uint64_t traceStart = traceBegin();
+        while(batch->count < BATCH_LINES && batch->textLen < batchBytes) {
+            if(!carry && (read = readCompleteLine(&line, &len, fp)) < 0) {
+                break;
+            }
+            lineNo += !carry;
+            // With --unordered, narrow and wide lines go in separate batches
+            carry = UNORDERED && batch->count > 0 &&
+                (read > HEAVY_WIDTH) != batch->heavy;
+            if(carry) {
+                break;
+            }
+            appendLine(batch, line, read, lineNo);
+            // Wide lines are scheduled one at a time
+            if(UNORDERED && batch->heavy) {
+                break;
+            }
+            if(lineNo == LINE_LAST) {
+                read = -1;
+                break;
+            }
+        }
+        traceEnd("read", traceStart, 0, PATTERN_NONE);
+        traceStart = traceBegin();
+        status = parseBatch(batch, &unexpected);
+        traceEnd("parse", traceStart, 0, PATTERN_NONE);
+        // A carried line belongs to the next batch
+        batch->inputEnd = status == LINE_OK ? ftell(fp) - carry * read : -1;
+        batch->lineNoEnd = lineNo - carry;
+        stats->readNs += nowNs() - start;
+
+        if(batch->count > 0) {
+            submitBatch(&pool, batch);
+        }
+        else {
+            // Nothing to classify, e.g. only blank lines, the slot is free
+            // again
+            batch->printed = true;
+        }
+        // Print whatever is already done without waiting
+        while(printNextBatch(&pool, false, stats)) {
+        }
+        checkLatencySnapshot();
+        if(read == LINE_PENDING && status == LINE_OK) {
+            // All the input has been read in follow mode
+            while(printNextBatch(&pool, true, stats)) {
+            }
+            read = followInput(fp, lineNo) ? 0 : -1;
+        }
+    }
+    // Print the rest of the results before reporting any errors, like play
+    // does
+    while(printNextBatch(&pool, true, stats)) {
+    }
+    uint64_t traceStart = traceBegin();
+    fflush(OUTPUT);
+    traceEnd("flush", traceStart, 0, PATTERN_NONE);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.closing = true;
+    pthread_cond_broadcast(&pool.workAvailable);
+    pthread_mutex_unlock(&pool.lock);
+    for(int i = 0; i < jobs; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+        stats->simNs += pool.workers[i].simNs;
+        stats->waitNs += pool.workers[i].waitNs;
+    }
+    stats->wallNs += nowNs() - startWall;
+    if(status != LINE_OK) {
+        exitOnLineError(status, unexpected);
+    }
+
+    for(int i = 0; i < pool.numBatches; i++) {
+        memSub(MEM_QUEUES, pool.batches[i].textSize);
+        free(pool.batches[i].text);
+    }
+    memSub(MEM_QUEUES, pool.numBatches * (sizeof(Batch) + sizeof(Batch*)));
+    free(pool.batches);
+    free(pool.workers);
+    free(pool.queue);
+    pthread_cond_destroy(&pool.memoryAvailable);
+    pthread_cond_destroy(&pool.batchDone);
+    pthread_cond_destroy(&pool.workAvailable);
+    pthread_mutex_destroy(&pool.lock);
+    fclose(fp);
+    freeLine(line, len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void runScaling(char* textfile) {
+    // Classify the file with 1, 2, 4, ... worker threads up to the number of
+    // online CPUs and report how the run time scales. The results are
+    // discarded.
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus < 1) {
+        cpus = 1;
+    }
+    OUTPUT = fopen("/dev/null", "w");
+    if(OUTPUT == NULL) {
+        fprintf(stderr, "ERROR: failed to open file: \"/dev/null\"\n");
+        exit(1);
+    }
+    // Columns: speedup and efficiency relative to one worker thread; the
+    // share of the worker threads' time spent simulating and waiting for
+    // work; the share of the wall time the main thread spent reading,
+    // waiting for the oldest batch in the reorder window and printing.
+    printf("%7s %9s %8s %6s %10s %6s %6s %6s %6s %6s\n",
+        "threads", "wall[s]", "speedup", "eff", "sim[us/l]",
+        "sim%", "queue%", "read%", "stall%", "out%");
+    double baseline = 0;
+    for(int jobs = 1; ; jobs = jobs * 2 < cpus ? jobs * 2 : cpus) {
+        PoolStats stats = {0};
+        playParallel(textfile, jobs, &stats);
+        double wall = stats.wallNs / 1e9;
+        double workerNs = (double)stats.wallNs * jobs;
+        if(jobs == 1) {
+            baseline = wall;
+        }
+        printf("%7d %9.3f %8.2f %6.2f %10.2f %6.1f %6.1f %6.1f %6.1f %6.1f\n",
+            jobs, wall, baseline / wall, baseline / wall / jobs,
+            stats.lines ? stats.simNs / 1e3 / stats.lines : 0.0,
+            100.0 * stats.simNs / workerNs, 100.0 * stats.waitNs / workerNs,
+            100.0 * stats.readNs / stats.wallNs,
+            100.0 * stats.stallNs / stats.wallNs,
+            100.0 * stats.outputNs / stats.wallNs);
+        fflush(stdout);
+        if(jobs == cpus) {
+            break;
+        }
+    }
+    fclose(OUTPUT);
+    OUTPUT = stdout;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Collision search: every ordered pair of objects of a library is placed on
+// one line, the left object at each of its phases, then a gap of blanks and
+// the right object at each of its phases, and the line is classified. The
+// free evolution of every object is simulated once and cached. As long as
+// the filled squares of the two objects are at least COLLISION_DISTANCE
+// squares apart, no block of 5 squares holds filled squares of both, so the
+// next line is the next lines of the two free evolutions side by side and is
+// composed from the cache. Only the rounds after the objects have come
+// closer than that are simulated. The outcomes of the collisions where the
+// objects interact are reported the first time they are seen.
+#define COLLISION_DISTANCE 5
+
+// Rounds of free evolution cached per object: MAX_ROUNDS from every phase
+#define OBJECT_ROUNDS (2 * MAX_ROUNDS)
+
+typedef struct CollisionObject {
+    char* name;
+    // Free evolution: the stripped line of every round, its length and the
+    // column of its first square on the object's own line. Blank lines have
+    // length 0.
+    char* rows[OBJECT_ROUNDS];
+    int lens[OBJECT_ROUNDS];
+    int lefts[OBJECT_ROUNDS];
+    // Class of the object on its own and the number of phases it is placed
+    // at: the period of blinking and gliding objects, otherwise 1
+    Pattern pattern;
+    int phases;
+} CollisionObject;
+
+typedef struct CollisionStats {
+    long collisions;
+    long interacting;
+    long novel;
+    // Rounds composed from the cached evolutions and rounds simulated
+    long composedRounds;
+    long simulatedRounds;
+} CollisionStats;
+
+// Keys of the outcomes seen so far, in an open addressing hash set. 0 marks
+// an empty slot.
+typedef struct OutcomeSet {
+    uint64_t* keys;
+    size_t size;
+    size_t count;
+} OutcomeSet;
+
+void evolveObject(CollisionObject* object, char* line) {
+    // Classify the object on the given line, which must already be
+    // validated, and cache its free evolution
+    LineResult result = {0};
+    classifyLine(line, &result);
+    object->pattern = result.pattern;
+    object->phases = result.matchRound >= 0 ?
+        result.rounds - result.matchRound : 1;
+    int shift;
+    GameState* game = newGameState(padTrimLineShift(line, &shift));
+    game->engine = selectEngine(line, strlen(line));
+    game->origin = -shift;
+    for(int r = 0; r < OBJECT_ROUNDS; r++) {
+        // The evolution stops at the first blank line
+        if(r > 0 && object->lens[r-1] > 0) {
+            fillNextLine(game);
+        }
+        StackEntry* entry = game->linesHead;
+        object->lens[r] = r > 0 && object->lens[r-1] == 0 ?
+            0 : entry->dataStrippedLen;
+        object->lefts[r] = game->origin + entry->dataStrippedIdx;
+        object->rows[r] = strndup(entry->dataStripped, object->lens[r]);
+        if(object->rows[r] == NULL) {
+            printf("ERROR: memory allocation failed\n");
+            exit(1);
+        }
+        memAdd(MEM_CACHES, object->lens[r] + 1);
+    }
+    deallocateGameState(game);
+}
+
+void freeObjects(CollisionObject* objects, int count) {
+    for(int i = 0; i < count; i++) {
+        for(int r = 0; r < OBJECT_ROUNDS; r++) {
+            memSub(MEM_CACHES, objects[i].lens[r] + 1);
+            free(objects[i].rows[r]);
+        }
+        free(objects[i].name);
+    }
+    memSub(MEM_CACHES, count * sizeof(CollisionObject));
+    free(objects);
+}
+
+CollisionObject* readObjects(char* path, int* count) {
+    // Read the object library: one object per line in the input format,
+    // optionally followed by whitespace and a name. Blank lines are
+    // skipped. Exit on errors.
+    FILE* fp = openInput(path);
+    CollisionObject* objects = NULL;
+    char* line = NULL;
+    size_t len = 0;
+    long lineNo = 0;
+    *count = 0;
+    while(readLine(&line, &len, fp) != -1) {
+        lineNo++;
+        char* row = line + strspn(line, " \t");
+        size_t rowLen = strcspn(row, " \t\r\n");
+        char* name = row + rowLen + strspn(row + rowLen, " \t");
+        name[strcspn(name, " \t\r\n")] = '\0';
+        row[rowLen] = '\0';
+        if(rowLen == 0) {
+            continue;
+        }
+        if(rowLen >= MAX_LINE_LEN || strspn(row, ".#") != rowLen ||
+           strchr(row, FILLED) == NULL) {
+            fprintf(stderr, "ERROR: invalid object on line %ld of \"%s\"\n",
+                lineNo, path);
+            exit(1);
+        }
+        objects = realloc(objects, (*count + 1) * sizeof(CollisionObject));
+        if(objects == NULL) {
+            printf("ERROR: memory allocation failed\n");
+            exit(1);
+        }
+        memAdd(MEM_CACHES, sizeof(CollisionObject));
+        CollisionObject* object = &objects[(*count)++];
+        object->name = strdup(*name != '\0' ? name : row);
+        if(object->name == NULL) {
+            printf("ERROR: memory allocation failed\n");
+            exit(1);
+        }
+        for(size_t i = 0; i < rowLen; i++) {
+            row[i] = row[i] == EMPTY ? ' ' : FILLED;
+        }
+        evolveObject(object, row);
+    }
+    fclose(fp);
+    freeLine(line, len);
+    return objects;
+}
+
+bool addOutcome(OutcomeSet* set, uint64_t key) {
+    // Add the key to the set. Return false if it was there already.
+    key |= 1;
+    if(2 * (set->count + 1) > set->size) {
+        OutcomeSet grown = {NULL, set->size ? 2 * set->size : 1024, 0};
+        grown.keys = calloc(grown.size, sizeof(uint64_t));
+        if(grown.keys == NULL) {
+            printf("ERROR: memory allocation failed\n");
+            exit(1);
+        }
+        for(size_t i = 0; i < set->size; i++) {
+            if(set->keys[i] != 0) {
+                addOutcome(&grown, set->keys[i]);
+            }
+        }
+        memSub(MEM_CACHES, set->size * sizeof(uint64_t));
+        memAdd(MEM_CACHES, grown.size * sizeof(uint64_t));
+        free(set->keys);
+        *set = grown;
+    }
+    size_t i = key & (set->size - 1);
+    while(set->keys[i] != 0) {
+        if(set->keys[i] == key) {
+            return false;
+        }
+        i = (i + 1) & (set->size - 1);
+    }
+    set->keys[i] = key;
+    set->count++;
+    return true;
+}
+
+uint64_t outcomeKey(GameState* game, Pattern pattern) {
+    // Key of the outcome of a game: the class and, for blinking and gliding,
+    // the period and the lines of one period. The lines are hashed in the
+    // order that starts from the smallest hash, so that the same outcome
+    // reached at a different phase has the same key. Games of the other
+    // class do not recur, so they are told apart by the rounds played and
+    // their last line. Vanishing is a single outcome.
+    uint64_t key = pattern;
+    if(pattern == PATTERN_OTHER) {
+        key = key * 0x100000001b3ULL ^ game->linesHead->pos;
+        return (key ^ hashRow(game->linesHead->dataStripped,
+            game->linesHead->dataStrippedLen)) * 0x100000001b3ULL;
+    }
+    if(pattern != PATTERN_BLINKING && pattern != PATTERN_GLIDING) {
+        return key;
+    }
+    int period = game->linesHead->pos - game->match->pos;
+    uint64_t hashes[MAX_ROUNDS];
+    int first = 0;
+    StackEntry* entry = game->linesHead;
+    for(int i = 0; i < period; i++, entry = entry->next) {
+        hashes[i] = hashRow(entry->dataStripped, entry->dataStrippedLen);
+        if(hashes[i] < hashes[first]) {
+            first = i;
+        }
+    }
+    key = key * 0x100000001b3ULL ^ period;
+    for(int i = 0; i < period; i++) {
+        key = (key ^ hashes[(first + i) % period]) * 0x100000001b3ULL;
+    }
+    return key;
+}
+
+void composeLine(GameState* game, CollisionObject* left, int leftRound,
+                 int leftColumn, CollisionObject* right, int rightRound,
+                 int rightColumn) {
+    // Push the next line of the game composed from the cached lines of the
+    // free evolutions at the given rounds. The columns are the offsets of
+    // the free evolutions on the input line.
+    int len = game->linesHead->dataStrlen + 1;
+    if(game->scratchSize < len) {
+        memSub(MEM_ROW_BUFFERS, game->scratchSize);
+        memAdd(MEM_ROW_BUFFERS, len);
+        free(game->scratch);
+        game->scratch = malloc(len);
+        if(game->scratch == NULL) {
+            printf("ERROR: memory allocation failed\n");
+            exit(1);
+        }
+        game->scratchSize = len;
+        game->allocBytes += len;
+    }
+    char* templine = game->scratch;
+    memset(templine, ' ', len-1);
+    templine[len-1] = '\0';
+    if(left->lens[leftRound] > 0) {
+        memcpy(templine - game->origin + leftColumn + left->lefts[leftRound],
+            left->rows[leftRound], left->lens[leftRound]);
+    }
+    if(right->lens[rightRound] > 0) {
+        memcpy(templine - game->origin + rightColumn +
+            right->lefts[rightRound], right->rows[rightRound],
+            right->lens[rightRound]);
+    }
+    game->population = countFilled(templine, len - 1);
+    pushFilledLine(game, templine);
+}
+
+bool collide(CollisionObject* left, int leftPhase, CollisionObject* right,
+             int rightPhase, int gap, OutcomeSet* seen,
+             CollisionStats* stats) {
+    // Classify the collision of the given objects and report its outcome if
+    // the objects interact and the outcome has not been seen yet. Return
+    // true if the objects interact.
+    //
+    // Columns are counted from the first square of the left object on the
+    // input line, and the free evolutions are shifted to start there.
+    int leftColumn = -left->lefts[leftPhase];
+    int rightColumn = left->lens[leftPhase] + gap - right->lefts[rightPhase];
+    // Find the round the objects meet from the cached evolutions alone. If
+    // they do not meet before the last round, the game is not played.
+    int meet = 0;
+    while(meet < MAX_ROUNDS - 1) {
+        int l = leftPhase + meet;
+        int r = rightPhase + meet;
+        if(left->lens[l] > 0 && right->lens[r] > 0 &&
+           rightColumn + right->lefts[r] -
+           (leftColumn + left->lefts[l] + left->lens[l] - 1) <
+           COLLISION_DISTANCE) {
+            break;
+        }
+        meet++;
+    }
+    stats->collisions++;
+    if(meet == MAX_ROUNDS - 1) {
+        return false;
+    }
+    int width = left->lens[leftPhase] + gap + right->lens[rightPhase];
+    char* line = malloc(width + 1);
+    if(line == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    memset(line, ' ', width);
+    line[width] = '\0';
+    memcpy(line, left->rows[leftPhase], left->lens[leftPhase]);
+    memcpy(line + width - right->lens[rightPhase], right->rows[rightPhase],
+        right->lens[rightPhase]);
+    int shift;
+    GameState* game = newGameState(padTrimLineShift(line, &shift));
+    game->engine = selectEngine(line, width);
+    game->origin = -shift;
+    free(line);
+
+    // The game may still end before the objects meet
+    bool interacting = false;
+    Pattern pattern = PATTERN_NONE;
+    for(int t = 0; linesFilled(game) < MAX_ROUNDS; t++) {
+        interacting = t >= meet;
+        if(interacting) {
+            fillNextLine(game);
+            stats->simulatedRounds++;
+            COUNT(cacheMisses, 1);
+        }
+        else {
+            composeLine(game, left, leftPhase + t + 1, leftColumn, right,
+                rightPhase + t + 1, rightColumn);
+            stats->composedRounds++;
+            COUNT(cacheHits, 1);
+        }
+        pattern = detectPattern(game);
+        if(pattern != PATTERN_NONE) {
+            break;
+        }
+    }
+    if(interacting) {
+        stats->interacting++;
+        if(addOutcome(seen, outcomeKey(game, pattern))) {
+            stats->novel++;
+            int period = pattern == PATTERN_BLINKING ||
+                pattern == PATTERN_GLIDING ?
+                game->linesHead->pos - game->match->pos : 0;
+            fprintf(OUTPUT, "%s %d %d %s %d %s %d %d ", PATTERN_NAMES[pattern],
+                period, linesFilled(game) - 1, left->name, leftPhase,
+                right->name, rightPhase, gap);
+            StackEntry* last = game->linesHead;
+            for(int i = 0; i < last->dataStrippedLen; i++) {
+                fputc(last->dataStripped[i] == ' ' ? EMPTY : FILLED, OUTPUT);
+            }
+            fputs(last->dataStrippedLen > 0 ? "\n" : ".\n", OUTPUT);
+        }
+    }
+    deallocateGameState(game);
+    return interacting;
+}
+
+void runCollisions(char* library, LineRange gaps, int maxPhases) {
+    // Collide every ordered pair of objects of the library at all their
+    // phases, up to maxPhases, and at all the gaps in the given range
+    int count;
+    CollisionObject* objects = readObjects(library, &count);
+    OutcomeSet seen = {0};
+    CollisionStats stats = {0};
+    fprintf(OUTPUT, "# class period rounds left phase right phase gap "
+        "line\n");
+    for(int a = 0; a < count; a++) {
+        for(int b = 0; b < count; b++) {
+            CollisionObject* left = &objects[a];
+            CollisionObject* right = &objects[b];
+            for(int pa = 0; pa < left->phases && pa < maxPhases; pa++) {
+                for(int pb = 0; pb < right->phases && pb < maxPhases; pb++) {
+                    for(int gap = gaps.first; gap <= gaps.last; gap++) {
+                        collide(left, pa, right, pb, gap, &seen, &stats);
+                    }
+                }
+            }
+        }
+    }
+    long rounds = stats.composedRounds + stats.simulatedRounds;
+    fprintf(OUTPUT, "# %ld collisions, %ld interacting, %ld novel outcomes, "
+        "%.1f%% of %ld rounds composed from the cache\n", stats.collisions,
+        stats.interacting, stats.novel,
+        rounds ? 100.0 * stats.composedRounds / rounds : 0.0, rounds);
+    memSub(MEM_CACHES, seen.size * sizeof(uint64_t));
+    free(seen.keys);
+    freeObjects(objects, count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Object catalog: with --catalog, every input line is first matched against
+// the objects of a library like the one of the collision search, at each of
+// their phases. The lines are compared as runs of filled and blank squares,
+// so that all the catalogued objects on a line are found in one pass over
+// its runs with an Aho-Corasick automaton. If the line is made of
+// catalogued objects only and the filled squares of the objects stay at
+// least COLLISION_DISTANCE squares apart until the game ends, every line of
+// the game is the cached lines of the objects side by side. The class is
+// then found by comparing these composed lines, round by round like
+// detectPattern does, without filling any line. Otherwise the game is
+// played as usual.
+//
+// The composed lines are compared by polynomial hashes modulo 2^64 with an
+// odd base, which are summed from the hashes of the cached lines, and lines
+// with equal hashes are composed and compared square by square. The hashes
+// only pick the lines worth comparing, so their collisions cost time but
+// never change a result.
+#define HASH_BASE 0x1f3d5b79a2c4e687ULL
+
+// Longest composed line that can be hashed
+#define HASH_POWERS (MAX_LINE_LEN + 4 * OBJECT_ROUNDS)
+
+typedef struct CatalogNode {
+    // Parent node and the run that leads here from it, see runSymbol
+    int parent;
+    int run;
+    int depth;
+    // Node of the longest proper suffix of the runs leading here
+    int fail;
+    // Pattern that ends here, -1 if none, and the next node on the fail
+    // chain where a pattern ends, -1 if none
+    int pattern;
+    int output;
+} CatalogNode;
+
+typedef struct CatalogEdge {
+    // (parent << 32 | run) + 1, 0 marks an empty slot
+    uint64_t key;
+    int child;
+} CatalogEdge;
+
+typedef struct CatalogPattern {
+    // Object at the given phase, and the number of runs of the line
+    CollisionObject* object;
+    int phase;
+    int runs;
+} CatalogPattern;
+
+struct Catalog {
+    CollisionObject* objects;
+    int numObjects;
+    CatalogPattern* patterns;
+    int numPatterns;
+    // Trie of the runs of the patterns, node 0 is the root
+    CatalogNode* nodes;
+    int numNodes;
+    // Edges of the trie in an open addressing hash table
+    CatalogEdge* edges;
+    size_t edgesSize;
+    size_t numEdges;
+    // hashes[i * OBJECT_ROUNDS + r]: hash of line r of object i
+    uint64_t* hashes;
+    // powers[i]: HASH_BASE^i
+    uint64_t* powers;
+};
+
+// Catalogued object found on an input line
+typedef struct PlacedObject {
+    CatalogPattern* pattern;
+    // Column of the first square of the object on the input line
+    int column;
+} PlacedObject;
+
+int runSymbol(bool filled, int len) {
+    return 2 * len + !filled;
+}
+
+int lineRuns(char* line, int len, int* runs, int* starts) {
+    // Store the runs of the line without the blank runs at its ends, and
+    // the column where each starts. Return the number of runs.
+    int count = 0;
+    for(int i = 0; i < len;) {
+        int j = i;
+        while(j < len && line[j] == line[i]) {
+            j++;
+        }
+        bool filled = line[i] != ' ';
+        if(filled || (i > 0 && j < len)) {
+            runs[count] = runSymbol(filled, j - i);
+            starts[count++] = i;
+        }
+        i = j;
+    }
+    return count;
+}
+
+size_t edgeSlot(Catalog* catalog, uint64_t key) {
+    // Slot of the key in the edge table, or the empty slot where it goes
+    size_t mask = catalog->edgesSize - 1;
+    size_t i = (key * 0x9e3779b97f4a7c15ULL >> 32) & mask;
+    while(catalog->edges[i].key != 0 && catalog->edges[i].key != key) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+int findChild(Catalog* catalog, int node, int run) {
+    // Child of the node along the run, -1 if none
+    if(catalog->numEdges == 0) {
+        return -1;
+    }
+    uint64_t key = ((uint64_t)node << 32 | (uint32_t)run) + 1;
+    CatalogEdge* edge = &catalog->edges[edgeSlot(catalog, key)];
+    return edge->key != 0 ? edge->child : -1;
+}
+
+void addEdge(Catalog* catalog, uint64_t key, int child) {
+    if(2 * (catalog->numEdges + 1) > catalog->edgesSize) {
+        CatalogEdge* old = catalog->edges;
+        size_t oldSize = catalog->edgesSize;
+        catalog->edgesSize = oldSize ? 2 * oldSize : 1024;
+        catalog->edges = calloc(catalog->edgesSize, sizeof(CatalogEdge));
+        if(catalog->edges == NULL) {
+            printf("ERROR: memory allocation failed\n");
+            exit(1);
+        }
+        memAdd(MEM_CACHES, (catalog->edgesSize - oldSize) *
+            sizeof(CatalogEdge));
+        for(size_t i = 0; i < oldSize; i++) {
+            if(old[i].key != 0) {
+                catalog->edges[edgeSlot(catalog, old[i].key)] = old[i];
+            }
+        }
+        free(old);
+    }
+    CatalogEdge* edge = &catalog->edges[edgeSlot(catalog, key)];
+    edge->key = key;
+    edge->child = child;
+    catalog->numEdges++;
+}
+
+int addNode(Catalog* catalog, int parent, int run) {
+    // Add a child to the trie and return it
+    catalog->nodes = realloc(catalog->nodes,
+        (catalog->numNodes + 1) * sizeof(CatalogNode));
+    if(catalog->nodes == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    memAdd(MEM_CACHES, sizeof(CatalogNode));
+    int node = catalog->numNodes++;
+    CatalogNode* new = &catalog->nodes[node];
+    new->parent = parent;
+    new->run = run;
+    new->depth = parent >= 0 ? catalog->nodes[parent].depth + 1 : 0;
+    new->fail = 0;
+    new->pattern = -1;
+    new->output = -1;
+    if(parent >= 0) {
+        addEdge(catalog, ((uint64_t)parent << 32 | (uint32_t)run) + 1, node);
+    }
+    return node;
+}
+
+int nextNode(Catalog* catalog, int node, int run) {
+    // Follow the run from the node, falling back along the fail links
+    while(true) {
+        int child = findChild(catalog, node, run);
+        if(child >= 0) {
+            return child;
+        }
+        if(node == 0) {
+            return 0;
+        }
+        node = catalog->nodes[node].fail;
+    }
+}
+
+void linkCatalog(Catalog* catalog) {
+    // Set the fail and output links of the trie. The nodes are linked in
+    // the order of their depth, since the links point to shallower nodes.
+    int maxDepth = 0;
+    for(int i = 0; i < catalog->numNodes; i++) {
+        if(catalog->nodes[i].depth > maxDepth) {
+            maxDepth = catalog->nodes[i].depth;
+        }
+    }
+    int* first = calloc(maxDepth + 2, sizeof(int));
+    int* order = malloc(catalog->numNodes * sizeof(int));
+    if(first == NULL || order == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    for(int i = 0; i < catalog->numNodes; i++) {
+        first[catalog->nodes[i].depth + 1]++;
+    }
+    for(int d = 0; d <= maxDepth; d++) {
+        first[d + 1] += first[d];
+    }
+    for(int i = 0; i < catalog->numNodes; i++) {
+        order[first[catalog->nodes[i].depth]++] = i;
+    }
+    for(int i = 1; i < catalog->numNodes; i++) {
+        CatalogNode* node = &catalog->nodes[order[i]];
+        if(node->parent != 0) {
+            int fail = catalog->nodes[node->parent].fail;
+            node->fail = nextNode(catalog, fail, node->run);
+        }
+        CatalogNode* fail = &catalog->nodes[node->fail];
+        node->output = fail->pattern >= 0 ? node->fail : fail->output;
+    }
+    free(first);
+    free(order);
+}
+
+Catalog* readCatalog(char* path) {
+    // Read the catalog in the format of the collision library and build
+    // the automaton over all the phases of its objects. Exit on errors.
+    Catalog* catalog = calloc(1, sizeof(Catalog));
+    if(catalog == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    memAdd(MEM_CACHES, sizeof(Catalog));
+    catalog->objects = readObjects(path, &catalog->numObjects);
+    catalog->powers = malloc(HASH_POWERS * sizeof(uint64_t));
+    catalog->hashes = calloc((size_t)catalog->numObjects * OBJECT_ROUNDS,
+        sizeof(uint64_t));
+    int* runs = malloc(HASH_POWERS * sizeof(int));
+    int* starts = malloc(HASH_POWERS * sizeof(int));
+    if(catalog->powers == NULL || (catalog->hashes == NULL &&
+       catalog->numObjects > 0) || runs == NULL || starts == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    memAdd(MEM_CACHES, HASH_POWERS * sizeof(uint64_t) +
+        (size_t)catalog->numObjects * OBJECT_ROUNDS * sizeof(uint64_t));
+    catalog->powers[0] = 1;
+    for(int i = 1; i < HASH_POWERS; i++) {
+        catalog->powers[i] = catalog->powers[i-1] * HASH_BASE;
+    }
+    addNode(catalog, -1, 0);
+    for(int i = 0; i < catalog->numObjects; i++) {
+        CollisionObject* object = &catalog->objects[i];
+        for(int r = 0; r < OBJECT_ROUNDS; r++) {
+            uint64_t hash = 0;
+            for(int j = 0; j < object->lens[r]; j++) {
+                if(object->rows[r][j] != ' ') {
+                    hash += catalog->powers[j];
+                }
+            }
+            catalog->hashes[i * OBJECT_ROUNDS + r] = hash;
+        }
+        for(int phase = 0; phase < object->phases; phase++) {
+            if(object->lens[phase] == 0) {
+                continue;
+            }
+            int count = lineRuns(object->rows[phase], object->lens[phase],
+                runs, starts);
+            int node = 0;
+            for(int j = 0; j < count; j++) {
+                int child = findChild(catalog, node, runs[j]);
+                node = child >= 0 ? child : addNode(catalog, node, runs[j]);
+            }
+            // The same line at another phase or of another object has the
+            // same evolution, the first one is kept
+            if(catalog->nodes[node].pattern >= 0) {
+                continue;
+            }
+            catalog->patterns = realloc(catalog->patterns,
+                (catalog->numPatterns + 1) * sizeof(CatalogPattern));
+            if(catalog->patterns == NULL) {
+                printf("ERROR: memory allocation failed\n");
+                exit(1);
+            }
+            memAdd(MEM_CACHES, sizeof(CatalogPattern));
+            CatalogPattern* pattern = &catalog->patterns[catalog->numPatterns];
+            pattern->object = object;
+            pattern->phase = phase;
+            pattern->runs = count;
+            catalog->nodes[node].pattern = catalog->numPatterns++;
+        }
+    }
+    free(runs);
+    free(starts);
+    linkCatalog(catalog);
+    return catalog;
+}
+
+void freeCatalog(Catalog* catalog) {
+    memSub(MEM_CACHES, sizeof(Catalog) +
+        catalog->numPatterns * sizeof(CatalogPattern) +
+        catalog->numNodes * sizeof(CatalogNode) +
+        catalog->edgesSize * sizeof(CatalogEdge) +
+        HASH_POWERS * sizeof(uint64_t) +
+        (size_t)catalog->numObjects * OBJECT_ROUNDS * sizeof(uint64_t));
+    freeObjects(catalog->objects, catalog->numObjects);
+    free(catalog->patterns);
+    free(catalog->nodes);
+    free(catalog->edges);
+    free(catalog->hashes);
+    free(catalog->powers);
+    free(catalog);
+}
+
+int placeObjects(Catalog* catalog, char* line, int width, PlacedObject* placed,
+                 int* runs, int* starts, int* best, int* choice) {
+    // Cover the filled squares of the line with catalogued objects, as few
+    // as possible, and store them in placed from left to right. Return the
+    // number of objects, 0 if the line can not be covered. The arrays must
+    // have room for width entries.
+    int count = lineRuns(line, width, runs, starts);
+    if(count == 0) {
+        return 0;
+    }
+    // best[k]: fewest objects that cover the runs up to filled run k, with
+    // the last one ending there, and choice[k] that last pattern
+    int node = 0;
+    for(int k = 0; k < count; k++) {
+        node = nextNode(catalog, node, runs[k]);
+        best[k] = INT_MAX;
+        choice[k] = -1;
+        if(k % 2 == 1) {
+            continue;
+        }
+        int match = catalog->nodes[node].pattern >= 0 ?
+            node : catalog->nodes[node].output;
+        for(; match >= 0; match = catalog->nodes[match].output) {
+            int index = catalog->nodes[match].pattern;
+            int begin = k - catalog->patterns[index].runs + 1;
+            int before = begin == 0 ? 0 : best[begin - 2];
+            if(before != INT_MAX && before + 1 < best[k]) {
+                best[k] = before + 1;
+                choice[k] = index;
+            }
+        }
+    }
+    if(best[count - 1] == INT_MAX) {
+        return 0;
+    }
+    int objects = best[count - 1];
+    int k = count - 1;
+    for(int i = objects - 1; i >= 0; i--) {
+        CatalogPattern* pattern = &catalog->patterns[choice[k]];
+        int begin = k - pattern->runs + 1;
+        placed[i].pattern = pattern;
+        placed[i].column = starts[begin];
+        k = begin - 2;
+    }
+    return objects;
+}
+
+typedef struct ComposedRound {
+    // First filled square of the composed line, its length (0 if blank),
+    // its hash and the first column of the line on the stack of the game
+    int left;
+    int len;
+    uint64_t hash;
+    int origin;
+} ComposedRound;
+
+bool composeRound(Catalog* catalog, PlacedObject* placed, int count, int t,
+                  ComposedRound* round) {
+    // Compose round t of the objects. Return false if the line is too long
+    // to hash or if the objects are closer than COLLISION_DISTANCE squares
+    // to each other, i.e. the next line is not composed of their next lines.
+    round->len = 0;
+    round->hash = 0;
+    bool apart = true;
+    int right = 0;
+    for(int i = 0; i < count; i++) {
+        CollisionObject* object = placed[i].pattern->object;
+        int phase = placed[i].pattern->phase;
+        if(object->lens[phase + t] == 0) {
+            continue;
+        }
+        int left = placed[i].column + object->lefts[phase + t] -
+            object->lefts[phase];
+        if(round->len == 0) {
+            round->left = left;
+        }
+        else if(left - right < COLLISION_DISTANCE) {
+            apart = false;
+        }
+        right = left + object->lens[phase + t] - 1;
+        round->len = right - round->left + 1;
+    }
+    if(round->len > HASH_POWERS) {
+        return false;
+    }
+    for(int i = 0; i < count; i++) {
+        CollisionObject* object = placed[i].pattern->object;
+        int phase = placed[i].pattern->phase;
+        if(object->lens[phase + t] > 0) {
+            int left = placed[i].column + object->lefts[phase + t] -
+                object->lefts[phase];
+            uint64_t hash = catalog->hashes[(object - catalog->objects) *
+                OBJECT_ROUNDS + phase + t];
+            round->hash += hash * catalog->powers[left - round->left];
+        }
+    }
+    return apart;
+}
+
+void writeComposedLine(PlacedObject* placed, int count, int t,
+                       ComposedRound* round, char* line) {
+    // Write the stripped line of round t, round->len squares
+    memset(line, ' ', round->len);
+    for(int i = 0; i < count; i++) {
+        CollisionObject* object = placed[i].pattern->object;
+        int phase = placed[i].pattern->phase;
+        if(object->lens[phase + t] > 0) {
+            memcpy(line + placed[i].column + object->lefts[phase + t] -
+                object->lefts[phase] - round->left, object->rows[phase + t],
+                object->lens[phase + t]);
+        }
+    }
+}
+
+bool recognizeLine(Catalog* catalog, char* line, int width,
+                   LineResult* result) {
+    // Classify the line without playing the game if it is made of
+    // catalogued objects that do not interact before the game ends. Return
+    // false if the game has to be played.
+    size_t bytes = 4 * width * sizeof(int) + width * sizeof(PlacedObject);
+    int* runs = malloc(bytes);
+    if(runs == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    memAdd(MEM_ROW_BUFFERS, bytes);
+    PlacedObject* placed = (PlacedObject*)(runs + 4 * width);
+    int count = placeObjects(catalog, line, width, placed, runs, runs + width,
+        runs + 2 * width, runs + 3 * width);
+
+    // The rounds are composed and compared with the earlier rounds like
+    // detectPattern compares the lines of a game: the stripped lines for
+    // gliding, and for blinking also their columns on the stack of lines,
+    // whose first column moves left to keep 3 blanks before the line
+    ComposedRound rounds[MAX_ROUNDS];
+    Pattern pattern = PATTERN_NONE;
+    int match = -1;
+    int peakWidth = 0;
+    char* lines = NULL;
+    int t = 0;
+    for(; count > 0 && t < MAX_ROUNDS; t++) {
+        ComposedRound* round = &rounds[t];
+        bool apart = composeRound(catalog, placed, count, t, round);
+        if(round->len > HASH_POWERS) {
+            break;
+        }
+        round->origin = t == 0 ? 0 : rounds[t-1].origin;
+        if(round->len > 0 && round->left - 3 < round->origin) {
+            round->origin = round->left - 3;
+        }
+        if(round->len > peakWidth) {
+            peakWidth = round->len;
+        }
+        if(t > 0 && round->len == 0) {
+            pattern = PATTERN_VANISHING;
+            break;
+        }
+        for(int s = t - 1; s >= 0 && t > 0; s--) {
+            if(rounds[s].len != round->len ||
+               rounds[s].hash != round->hash) {
+                continue;
+            }
+            if(lines == NULL) {
+                lines = malloc(2 * HASH_POWERS);
+                if(lines == NULL) {
+                    printf("ERROR: memory allocation failed\n");
+                    exit(1);
+                }
+            }
+            writeComposedLine(placed, count, t, round, lines);
+            writeComposedLine(placed, count, s, &rounds[s],
+                lines + HASH_POWERS);
+            if(memcmp(lines, lines + HASH_POWERS, round->len) == 0) {
+                pattern = round->left - round->origin ==
+                    rounds[s].left - rounds[s].origin ?
+                    PATTERN_BLINKING : PATTERN_GLIDING;
+                match = s;
+                break;
+            }
+        }
+        if(pattern != PATTERN_NONE) {
+            break;
+        }
+        if(t + 1 >= MAX_ROUNDS) {
+            pattern = PATTERN_OTHER;
+            break;
+        }
+        // The next line is composed of the next lines of the objects only
+        // if they are apart now
+        if(!apart) {
+            break;
+        }
+    }
+    free(lines);
+    memSub(MEM_ROW_BUFFERS, bytes);
+    free(runs);
+    if(pattern == PATTERN_NONE) {
+        COUNT(cacheMisses, 1);
+        return false;
+    }
+    COUNT(cacheHits, 1);
+    result->pattern = pattern;
+    result->rounds = t;
+    result->matchRound = match;
+    result->period = match >= 0 ? t - match : 0;
+    result->shift = match >= 0 ? rounds[t].left - rounds[match].left : 0;
+    result->width = width;
+    result->peakWidth = peakWidth;
+    result->allocBytes = bytes;
+    result->engine = selectEngine(line, width);
+    result->series = NULL;
+    result->hashes = NULL;
+    result->objects = count;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Predecessor search: the lines that fill a given line are found by dynamic
+// programming on a de Bruijn graph. A node of the graph is a window of 4
+// consecutive squares of the line above and an edge appends a fifth square.
+// The 5 squares of an edge are the block of the middle square, so every edge
+// fills or leaves blank one square of the line below, and the predecessors
+// are the paths whose edges spell the given line. The paths are counted and
+// enumerated in time linear in the width of the line.
+//
+// Squares left of the line must stay blank, so the path starts from the
+// windows reachable from the blank window along edges that leave squares
+// blank, and ends on a window from which such edges lead back to the blank
+// window. If no path does that, no line of any width fills the given line.
+// Enumerated predecessors are limited to lines that extend at most a margin
+// of squares beyond the given line on either side, since any line can be
+// padded with squares that vanish on the next line.
+#define WINDOW_STATES 16
+
+bool edgeFills(int window, int square) {
+    // Whether the edge that appends the given square (0 or 1) to the given
+    // window fills the middle square of the block. The first square of the
+    // window is the highest bit.
+    int block = window << 1 | square;
+    return isFilledBelow(block & 4 ? FILLED : ' ',
+        __builtin_popcount(block));
+}
+
+int nextWindow(int window, int square) {
+    return (window << 1 | square) & (WINDOW_STATES - 1);
+}
+
+int blankClosure(int windows, bool backward) {
+    // Extend the set of windows (a bit mask) with the windows reachable
+    // from them, or with the windows they are reachable from if backward,
+    // along edges that leave squares blank
+    bool grown = true;
+    while(grown) {
+        grown = false;
+        for(int w = 0; w < WINDOW_STATES; w++) {
+            for(int c = 0; c <= 1; c++) {
+                int next = nextWindow(w, c);
+                if(edgeFills(w, c)) {
+                    continue;
+                }
+                int from = backward ? next : w;
+                int to = backward ? w : next;
+                if((windows >> from & 1) && !(windows >> to & 1)) {
+                    windows |= 1 << to;
+                    grown = true;
+                }
+            }
+        }
+    }
+    return windows;
+}
+
+int stepWindows(int windows, bool filled) {
+    // Windows reached from the given windows along edges that fill or leave
+    // blank the square
+    int next = 0;
+    for(int w = 0; w < WINDOW_STATES; w++) {
+        for(int c = 0; c <= 1 && (windows >> w & 1); c++) {
+            if(edgeFills(w, c) == filled) {
+                next |= 1 << nextWindow(w, c);
+            }
+        }
+    }
+    return next;
+}
+
+int stepWindowsBack(int windows, bool filled) {
+    // Windows from which the given windows are reached along edges that
+    // fill or leave blank the square
+    int previous = 0;
+    for(int w = 0; w < WINDOW_STATES; w++) {
+        for(int c = 0; c <= 1; c++) {
+            if(edgeFills(w, c) == filled &&
+               (windows >> nextWindow(w, c) & 1)) {
+                previous |= 1 << w;
+            }
+        }
+    }
+    return previous;
+}
+
+void explainNoPredecessor(char* line, int len) {
+    // Print why the line has no predecessor: the shortest run of squares no
+    // line fills, if there is one, otherwise the end of the line that can
+    // not border on blank squares.
+    //
+    // The runs are found in one pass. earliest[w] is the first square from
+    // which a path of the squares up to the current one reaches window w.
+    // A path from an earlier square passes through the windows reached from
+    // a later one, so the runs ending at the current square that no line
+    // fills are exactly the ones that start before all of earliest.
+    int earliest[WINDOW_STATES];
+    int first = -1;
+    int last = len;
+    for(int w = 0; w < WINDOW_STATES; w++) {
+        earliest[w] = -1;
+    }
+    for(int j = 0; j < len; j++) {
+        int next[WINDOW_STATES];
+        int start = j + 1;
+        for(int w = 0; w < WINDOW_STATES; w++) {
+            next[w] = -1;
+        }
+        for(int w = 0; w < WINDOW_STATES; w++) {
+            // A run may also start at square j from any window
+            int from = earliest[w] >= 0 ? earliest[w] : j;
+            for(int c = 0; c <= 1; c++) {
+                int to = nextWindow(w, c);
+                if(edgeFills(w, c) == (line[j] == FILLED) &&
+                   (next[to] < 0 || from < next[to])) {
+                    next[to] = from;
+                }
+            }
+        }
+        for(int w = 0; w < WINDOW_STATES; w++) {
+            earliest[w] = next[w];
+            if(next[w] >= 0 && next[w] < start) {
+                start = next[w];
+            }
+        }
+        if(start > 0 && j - (start - 1) < last - first) {
+            first = start - 1;
+            last = j;
+        }
+    }
+    if(first >= 0) {
+        fprintf(OUTPUT, "# no predecessor: no line fills squares %d-%d ",
+            first + 1, last + 1);
+        for(int i = first; i <= last; i++) {
+            fputc(line[i] == FILLED ? FILLED : EMPTY, OUTPUT);
+        }
+        fputc('\n', OUTPUT);
+        return;
+    }
+    int windows = blankClosure(1, false);
+    int i = 0;
+    while(i < len && (windows = stepWindows(windows, line[i] == FILLED))) {
+        i++;
+    }
+    if(i < len) {
+        fprintf(OUTPUT, "# no predecessor: squares 1-%d can not follow "
+            "blank squares\n", i + 1);
+        return;
+    }
+    windows = blankClosure(1, true);
+    i = len - 1;
+    while(i >= 0 && (windows = stepWindowsBack(windows, line[i] == FILLED))) {
+        i--;
+    }
+    if(i >= 0) {
+        fprintf(OUTPUT, "# no predecessor: squares %d-%d can not be followed "
+            "by blank squares\n", i + 1, len);
+    }
+    else {
+        fprintf(OUTPUT, "# no predecessor: the line can not be followed by "
+            "blank squares\n");
+    }
+}
+
+void findPredecessors(char* row, long maxCount, int margin) {
+    // Print up to maxCount lines that fill the given line and extend at most
+    // margin squares beyond it, or why there are none
+    char* line = row + strspn(row, ".");
+    int len = strlen(line);
+    while(len > 0 && line[len-1] == EMPTY) {
+        len--;
+    }
+    line[len] = '\0';
+    if(len == 0 || strspn(line, ".#") != (size_t)len || len >= MAX_LINE_LEN) {
+        fprintf(stderr, "ERROR: invalid line: \"%s\"\n", row);
+        exit(1);
+    }
+    // The predecessors are printed under the line with the margin
+    fputs("# predecessors of ", OUTPUT);
+    for(int i = 0; i < len + 2 * margin; i++) {
+        bool inside = i >= margin && i < len + margin;
+        fputc(inside ? line[i - margin] : EMPTY, OUTPUT);
+    }
+    fputc('\n', OUTPUT);
+    // Any width
+    int windows = blankClosure(1, false);
+    for(int i = 0; i < len && windows != 0; i++) {
+        windows = stepWindows(windows, line[i] == FILLED);
+    }
+    if((windows & blankClosure(1, true)) == 0) {
+        explainNoPredecessor(line, len);
+        return;
+    }
+
+    // Within the margin. Step k appends square k - margin of the line above
+    // (counting from the first square of the line) and fills square
+    // k - margin - 2 of the line below. counts[k][w] is the number of ways
+    // to complete the path from window w before step k, saturated at
+    // UINT64_MAX.
+    int steps = len + 2 * margin + 4;
+    uint64_t (*counts)[WINDOW_STATES] = calloc(steps + 1,
+        sizeof(*counts));
+    if(counts == NULL) {
+        printf("ERROR: memory allocation failed\n");
+        exit(1);
+    }
+    counts[steps][0] = 1;
+    for(int k = steps - 1; k >= 0; k--) {
+        int below = k - margin - 2;
+        bool filled = below >= 0 && below < len && line[below] == FILLED;
+        int squares = k < len + 2 * margin ? 2 : 1;
+        for(int w = 0; w < WINDOW_STATES; w++) {
+            for(int c = 0; c < squares; c++) {
+                if(edgeFills(w, c) == filled) {
+                    uint64_t n = counts[k+1][nextWindow(w, c)];
+                    counts[k][w] = counts[k][w] + n < n ?
+                        UINT64_MAX : counts[k][w] + n;
+                }
+            }
+        }
+    }
+    uint64_t total = counts[0][0];
+    for(uint64_t n = 0; n < total && n < (uint64_t)maxCount; n++) {
+        // Walk down the n'th path in the order where a blank square comes
+        // before a filled one
+        uint64_t rank = n;
+        int w = 0;
+        for(int k = 0; k < len + 2 * margin; k++) {
+            int below = k - margin - 2;
+            bool filled = below >= 0 && below < len && line[below] == FILLED;
+            int c = 0;
+            if(edgeFills(w, 0) != filled ||
+               counts[k+1][nextWindow(w, 0)] <= rank) {
+                if(edgeFills(w, 0) == filled) {
+                    rank -= counts[k+1][nextWindow(w, 0)];
+                }
+                c = 1;
+            }
+            fputc(c ? FILLED : EMPTY, OUTPUT);
+            w = nextWindow(w, c);
+        }
+        fputc('\n', OUTPUT);
+    }
+    if(total == UINT64_MAX) {
+        fprintf(OUTPUT, "# at least %llu", (unsigned long long)total);
+    }
+    else {
+        fprintf(OUTPUT, "# %llu", (unsigned long long)total);
+    }
+    fprintf(OUTPUT, " predecessor%s within %d squares of the line%s\n",
+        total == 1 ? "" : "s", margin,
+        total == 0 ? ", but wider ones exist" : "");
+    free(counts);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Programs that reuse the functions above (for instance the benchmark in
+// back-to-school-bench.c) include this file with BACK_TO_SCHOOL_NO_MAIN
+// defined and provide their own main.
+#ifndef BACK_TO_SCHOOL_NO_MAIN
+size_t parseSize(char* text) {
+    // Parse a size in bytes with an optional K, M or G suffix. Return 0 on
+    // errors.
+    char* end;
+    unsigned long long size = strtoull(text, &end, 10);
+    switch(*end) {
+    case 'G': case 'g':
+        size *= 1024;
+        // fall through
+    case 'M': case 'm':
+        size *= 1024;
+        // fall through
+    case 'K': case 'k':
+        size *= 1024;
+        end++;
+        break;
+    }
+    return *end == '\0' && end != text ? size : 0;
+}
+
+bool writeMemoryFile(char* path) {
+    FILE* out = fopen(path, "w");
+    if(out == NULL) {
+        fprintf(stderr,"ERROR: failed to open file: \"%s\"\n", path);
+        return false;
+    }
+    writeMemoryReport(out);
+    fclose(out);
+    return true;
+}
+
+void usage(char* name) {
+    printf("Usage: %s [options] <textfile>\n"
+        "Options:\n"
+        "  -j, --jobs N   classify the lines with N worker threads\n"
+        "  --scaling      benchmark the file with 1 to all CPUs worker\n"
+        "                 threads and report the scaling\n"
+        "  --stats FILE   write per-line statistics on FILE as JSON Lines\n"
+        "  --latency FILE write per-line latency percentiles on FILE at exit\n"
+        "                 and on SIGUSR1\n"
+        "  --perf FILE    write hardware performance counters of the\n"
+        "                 simulation and detection phases on FILE at exit\n"
+        "  --trace FILE   write a timeline of the run on FILE in Chrome\n"
+        "                 Trace Event format\n"
+        "  --memory FILE  write the memory use by subsystem on FILE at exit\n"
+        "  --max-memory N keep the memory use of the batches and games in\n"
+        "                 flight within N bytes (suffixes K, M and G)\n"
+        "  --engine NAME  fill the lines with the given engine (scalar,\n"
+        "                 window or sparse), or choose one per line with\n"
+        "                 auto (the default)\n"
+        "  --tune-file F  cache the calibration of auto on F (default\n"
+        "                 a file in ~/.cache/back-to-school)\n"
+        "  --diagram P    write the space-time diagram of every line on\n"
+        "                 P-<line number>.pbm\n"
+        "  --diagram-lines LIST\n"
+        "                 write the diagrams of the given lines only, e.g.\n"
+        "                 1,5,10-20\n"
+        "  --timeseries FILE\n"
+        "                 write the population, width and position of every\n"
+        "                 filled line on FILE in a columnar binary format\n"
+        "  --index FILE   write an index of the lines reached by every input\n"
+        "                 line on FILE, or read it with the queries below\n"
+        "  --query-row ROW\n"
+        "                 print the input lines that reach ROW, e.g. ..##.#\n"
+        "  --query-line N print the input lines that reach a line reached by\n"
+        "                 input line N\n"
+        "  -o, --output FILE\n"
+        "                 print the results on FILE instead of stdout\n"
+        "  --checkpoint FILE\n"
+        "                 write a checkpoint on FILE every 100000 lines\n"
+        "  --checkpoint-lines N\n"
+        "                 write the checkpoints every N lines instead\n"
+        "  --resume       continue from the checkpoint, if there is one\n"
+        "  -f, --follow   wait for lines appended to the input file and\n"
+        "                 classify them until interrupted\n"
+        "  --line N       classify input line N only\n"
+        "  --lines A-B    classify input lines A to B only\n"
+        "  --line-index FILE\n"
+        "                 find or count the lines with the line index on FILE\n"
+        "                 (default <textfile>.lines), built if needed\n"
+        "  --collide LIBRARY\n"
+        "                 collide every pair of objects of LIBRARY, one per\n"
+        "                 line, and print the new outcomes\n"
+        "  --gaps A-B     place the objects A to B squares apart (default\n"
+        "                 1-16)\n"
+        "  --phases N     place the objects at up to N of their phases\n"
+        "  --predecessors ROW\n"
+        "                 print the lines that fill ROW, e.g. ..##.#, or\n"
+        "                 why there are none\n"
+        "  --max-predecessors N\n"
+        "                 print at most N of them (default 16)\n"
+        "  --margin N     print the ones that extend at most N squares\n"
+        "                 beyond ROW (default 2)\n"
+        "  --unordered    print the results as soon as they are done, after\n"
+        "                 their line numbers, narrow lines first\n"
+        "  --heavy-width N\n"
+        "                 schedule lines wider than N squares (default 1024)\n"
+        "                 after the narrower ones with --unordered\n"
+        "  --binary-output FILE\n"
+        "                 write the results on FILE as fixed size records,\n"
+        "                 one for every input line, instead of printing them\n"
+        "  --catalog FILE classify the lines made of the objects of FILE, one\n"
+        "                 per line, without playing the game when they can\n"
+        "                 not interact\n",
+        name);
+}
+
+int main(int argc, char *argv[]) {
+    static struct option longOptions[] = {
+        {"jobs", required_argument, NULL, 'j'},
+        {"scaling", no_argument, NULL, 'S'},
+        {"stats", required_argument, NULL, 's'},
+        {"latency", required_argument, NULL, 'l'},
+        {"perf", required_argument, NULL, 'p'},
+        {"trace", required_argument, NULL, 't'},
+        {"memory", required_argument, NULL, 'm'},
+        {"max-memory", required_argument, NULL, 'M'},
+        {"engine", required_argument, NULL, 'e'},
+        {"tune-file", required_argument, NULL, 'T'},
+        {"diagram", required_argument, NULL, 'd'},
+        {"diagram-lines", required_argument, NULL, 'D'},
+        {"timeseries", required_argument, NULL, 'x'},
+        {"index", required_argument, NULL, 'i'},
+        {"query-row", required_argument, NULL, 'r'},
+        {"query-line", required_argument, NULL, 'n'},
+        {"output", required_argument, NULL, 'o'},
+        {"checkpoint", required_argument, NULL, 'c'},
+        {"checkpoint-lines", required_argument, NULL, 'C'},
+        {"resume", no_argument, NULL, 'R'},
+        {"follow", no_argument, NULL, 'f'},
+        {"line", required_argument, NULL, 'L'},
+        {"lines", required_argument, NULL, 'A'},
+        {"line-index", required_argument, NULL, 'I'},
+        {"collide", required_argument, NULL, 'k'},
+        {"gaps", required_argument, NULL, 'g'},
+        {"phases", required_argument, NULL, 'P'},
+        {"predecessors", required_argument, NULL, 'u'},
+        {"max-predecessors", required_argument, NULL, 'U'},
+        {"margin", required_argument, NULL, 'G'},
+        {"unordered", no_argument, NULL, 'O'},
+        {"heavy-width", required_argument, NULL, 'W'},
+        {"binary-output", required_argument, NULL, 'b'},
+        {"catalog", required_argument, NULL, 'a'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    int jobs = 1;
+    bool scaling = false;
+    char* statsFile = NULL;
+    char* latencyFile = NULL;
+    char* perfFile = NULL;
+    char* traceFile = NULL;
+    char* memoryFile = NULL;
+    char* tuneFile = NULL;
+    char* seriesFile = NULL;
+    char* indexFile = NULL;
+    char* queryRowText = NULL;
+    long queryLineNo = 0;
+    char* outputFile = NULL;
+    bool resume = false;
+    char* lineIndexFile = NULL;
+    char* binaryFile = NULL;
+    char* catalogFile = NULL;
+    LineRange* lineRange;
+    int ranges;
+    char* library = NULL;
+    LineRange gaps = {1, 16};
+    int maxPhases = MAX_ROUNDS;
+    char* predecessorRow = NULL;
+    long maxPredecessors = 16;
+    int margin = 2;
+    int opt;
+    while((opt = getopt_long(argc, argv, "j:o:fh", longOptions, NULL)) != -1) {
+        switch(opt) {
+        case 'j':
+            jobs = atoi(optarg);
+            if(jobs < 1) {
+                fprintf(stderr, "ERROR: invalid number of jobs: \"%s\"\n",
+                    optarg);
+                return 1;
+            }
+            break;
+        case 'S':
+            scaling = true;
+            break;
+        case 's':
+            statsFile = optarg;
+            break;
+        case 'l':
+            latencyFile = optarg;
+            break;
+        case 'p':
+            perfFile = optarg;
+            break;
+        case 't':
+            traceFile = optarg;
+            break;
+        case 'm':
+            memoryFile = optarg;
+            break;
+        case 'M':
+            MEMORY_BUDGET = parseSize(optarg);
+            if(MEMORY_BUDGET == 0) {
+                fprintf(stderr, "ERROR: invalid memory size: \"%s\"\n",
+                    optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+            FORCED_ENGINE = 0;
+            while(FORCED_ENGINE < ENGINES &&
+                  strcmp(optarg, ENGINE_NAMES[FORCED_ENGINE]) != 0) {
+                FORCED_ENGINE++;
+            }
+            if(FORCED_ENGINE == ENGINES && strcmp(optarg, "auto") != 0) {
+                fprintf(stderr, "ERROR: unknown engine: \"%s\"\n", optarg);
+                return 1;
+            }
+            break;
+        case 'T':
+            tuneFile = optarg;
+            break;
+        case 'd':
+            DIAGRAM_PREFIX = optarg;
+            break;
+        case 'x':
+            seriesFile = optarg;
+            break;
+        case 'i':
+            indexFile = optarg;
+            break;
+        case 'o':
+            outputFile = optarg;
+            break;
+        case 'c':
+            CHECKPOINT_FILE = optarg;
+            break;
+        case 'C':
+            CHECKPOINT_LINES = atol(optarg);
+            if(CHECKPOINT_LINES < 1) {
+                fprintf(stderr, "ERROR: invalid number of lines: \"%s\"\n",
+                    optarg);
+                return 1;
+            }
+            break;
+        case 'R':
+            resume = true;
+            break;
+        case 'f':
+            FOLLOW = true;
+            break;
+        case 'L':
+            LINE_FIRST = LINE_LAST = atol(optarg);
+            if(LINE_FIRST < 1) {
+                fprintf(stderr, "ERROR: invalid line number: \"%s\"\n",
+                    optarg);
+                return 1;
+            }
+            break;
+        case 'A':
+            if(!parseLineRanges(optarg, &lineRange, &ranges) || ranges != 1) {
+                fprintf(stderr, "ERROR: invalid line numbers: \"%s\"\n",
+                    optarg);
+                return 1;
+            }
+            LINE_FIRST = lineRange->first;
+            LINE_LAST = lineRange->last;
+            free(lineRange);
+            break;
+        case 'I':
+            lineIndexFile = optarg;
+            break;
+        case 'b':
+            binaryFile = optarg;
+            break;
+        case 'a':
+            catalogFile = optarg;
+            break;
+        case 'k':
+            library = optarg;
+            break;
+        case 'g':
+            if(!parseLineRanges(optarg, &lineRange, &ranges) || ranges != 1 ||
+               lineRange->last >= MAX_LINE_LEN) {
+                fprintf(stderr, "ERROR: invalid gaps: \"%s\"\n", optarg);
+                return 1;
+            }
+            gaps = *lineRange;
+            free(lineRange);
+            break;
+        case 'u':
+            predecessorRow = optarg;
+            break;
+        case 'O':
+            UNORDERED = true;
+            break;
+        case 'W':
+            HEAVY_WIDTH = atoi(optarg);
+            if(HEAVY_WIDTH < 1) {
+                fprintf(stderr, "ERROR: invalid width: \"%s\"\n", optarg);
+                return 1;
+            }
+            break;
+        case 'U':
+            maxPredecessors = atol(optarg);
+            if(maxPredecessors < 0) {
+                fprintf(stderr, "ERROR: invalid number of predecessors: "
+                    "\"%s\"\n", optarg);
+                return 1;
+            }
+            break;
+        case 'G':
+            margin = atoi(optarg);
+            if(margin < 0 || margin >= MAX_LINE_LEN) {
+                fprintf(stderr, "ERROR: invalid margin: \"%s\"\n", optarg);
+                return 1;
+            }
+            break;
+        case 'P':
+            maxPhases = atoi(optarg);
+            if(maxPhases < 1) {
+                fprintf(stderr, "ERROR: invalid number of phases: \"%s\"\n",
+                    optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            queryRowText = optarg;
+            break;
+        case 'n':
+            queryLineNo = atol(optarg);
+            if(queryLineNo < 1) {
+                fprintf(stderr, "ERROR: invalid line number: \"%s\"\n",
+                    optarg);
+                return 1;
+            }
+            break;
+        case 'D':
+            if(!parseLineRanges(optarg, &DIAGRAM_LINES, &DIAGRAM_RANGES)) {
+                fprintf(stderr, "ERROR: invalid line numbers: \"%s\"\n",
+                    optarg);
+                return 1;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(queryRowText != NULL || queryLineNo != 0) {
+        if(indexFile == NULL) {
+            fprintf(stderr, "ERROR: queries need an --index file\n");
+            return 1;
+        }
+        if(queryRowText != NULL) {
+            queryRow(indexFile, queryRowText);
+        }
+        if(queryLineNo != 0) {
+            queryLine(indexFile, queryLineNo);
+        }
+        return 0;
+    }
+    if((predecessorRow != NULL || library != NULL) &&
+       (statsFile != NULL || MEMORY_BUDGET != 0 || jobs != 1)) {
+        // The searches run on one thread and do not classify input lines
+        fprintf(stderr, "ERROR: --collide and --predecessors can not be "
+            "combined with --stats, --max-memory or --jobs\n");
+        return 1;
+    }
+    if(predecessorRow != NULL || library != NULL) {
+        OUTPUT = outputFile != NULL ? fopen(outputFile, "w") : stdout;
+        if(OUTPUT == NULL) {
+            fprintf(stderr,"ERROR: failed to open file: \"%s\"\n",
+                outputFile);
+            return 1;
+        }
+        if(predecessorRow != NULL) {
+            findPredecessors(predecessorRow, maxPredecessors, margin);
+        }
+        else {
+            if(FORCED_ENGINE == ENGINES) {
+                tuneEngines(tuneFile != NULL ? tuneFile : defaultTuneFile());
+            }
+            runCollisions(library, gaps, maxPhases);
+            flushHotCounters();
+#ifdef HOT_COUNTERS
+            writeHotCounters(stderr);
+#endif
+        }
+        if(OUTPUT != stdout && fclose(OUTPUT) != 0) {
+            fprintf(stderr, "ERROR: failed to write output: %s\n",
+                strerror(errno));
+            return 1;
+        }
+        return memoryFile != NULL && !writeMemoryFile(memoryFile);
+    }
+    if(optind >= argc) {
+        usage(argv[0]);
+        return 0;
+    }
+
+    char *textfile = argv[optind];
+    OUTPUT = stdout;
+    if(scaling) {
+        DIAGRAM_PREFIX = NULL;
+        CHECKPOINT_FILE = NULL;
+        FOLLOW = false;
+    }
+    if(FOLLOW && CHECKPOINT_FILE != NULL && indexFile != NULL) {
+        // The index is sorted at exit, so it can not be appended to
+        fprintf(stderr, "ERROR: --index can not be resumed in follow mode\n");
+        return 1;
+    }
+    if(LINE_FIRST != 0 && (FOLLOW || CHECKPOINT_FILE != NULL || scaling)) {
+        fprintf(stderr, "ERROR: --line and --lines can not be combined with "
+            "--follow, --checkpoint or --scaling\n");
+        return 1;
+    }
+    if(binaryFile != NULL && (FOLLOW || CHECKPOINT_FILE != NULL || scaling)) {
+        fprintf(stderr, "ERROR: --binary-output can not be combined with "
+            "--follow, --checkpoint or --scaling\n");
+        return 1;
+    }
+    if(LINE_FIRST != 0 || binaryFile != NULL) {
+        indexInput(textfile, lineIndexFile);
+    }
+    if(binaryFile != NULL) {
+        openBinaryOutput(binaryFile, INPUT_LINES);
+    }
+    if(FOLLOW) {
+        startFollowing(textfile);
+    }
+    if((CHECKPOINT_FILE != NULL || resume) && outputFile == NULL) {
+        fprintf(stderr, "ERROR: checkpoints need an --output file\n");
+        return 1;
+    }
+    if(UNORDERED && CHECKPOINT_FILE != NULL) {
+        // A checkpoint needs all the lines before it printed
+        fprintf(stderr, "ERROR: --unordered can not be checkpointed\n");
+        return 1;
+    }
+    if(resume && CHECKPOINT_FILE == NULL) {
+        fprintf(stderr, "ERROR: --resume needs a --checkpoint file\n");
+        return 1;
+    }
+    if(resume && readCheckpoint(CHECKPOINT_FILE, &RESUME)) {
+        SUMMARY = RESUME.summary;
+    }
+    if(outputFile != NULL && !scaling) {
+        OUTPUT = openOutputFile(outputFile, "w", CHECKPOINT_OUTPUT);
+        if(OUTPUT == NULL) {
+            fprintf(stderr,"ERROR: failed to open file: \"%s\"\n",
+                outputFile);
+            return 1;
+        }
+    }
+    if(FORCED_ENGINE == ENGINES) {
+        tuneEngines(tuneFile != NULL ? tuneFile : defaultTuneFile());
+    }
+    if(catalogFile != NULL) {
+        CATALOG = readCatalog(catalogFile);
+        // The cached evolutions can not shrink without losing the lines
+        // they recognize, so a catalog too large for the budget is refused.
+        // Half of the budget stays for the batches and the games.
+        if(MEMORY_BUDGET != 0 &&
+           memCurrent(MEM_CACHES) > MEMORY_BUDGET / 2) {
+            fprintf(stderr, "ERROR: the catalog takes %zu bytes, more than "
+                "half of the memory budget\n", memCurrent(MEM_CACHES));
+            return 1;
+        }
+    }
+    if(statsFile != NULL && !scaling) {
+        STATS = openOutputFile(statsFile, "w", CHECKPOINT_STATS);
+        if(STATS == NULL) {
+            fprintf(stderr,"ERROR: failed to open file: \"%s\"\n", statsFile);
+            return 1;
+        }
+        LINE_TIMING = true;
+    }
+    if(latencyFile != NULL && !scaling) {
+        LATENCY = fopen(latencyFile, "w");
+        if(LATENCY == NULL) {
+            fprintf(stderr,"ERROR: failed to open file: \"%s\"\n",
+                latencyFile);
+            return 1;
+        }
+        LINE_TIMING = true;
+        struct sigaction action = {0};
+        action.sa_handler = handleSigusr1;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &action, NULL);
+    }
+    if(perfFile != NULL && !scaling) {
+        PERF_REPORT = fopen(perfFile, "w");
+        if(PERF_REPORT == NULL) {
+            fprintf(stderr,"ERROR: failed to open file: \"%s\"\n", perfFile);
+            return 1;
+        }
+    }
+    if(traceFile != NULL && !scaling) {
+        TRACE_FILE = fopen(traceFile, "w");
+        if(TRACE_FILE == NULL) {
+            fprintf(stderr,"ERROR: failed to open file: \"%s\"\n",
+                traceFile);
+            return 1;
+        }
+        TRACE_START = nowNs();
+    }
+    if(seriesFile != NULL && !scaling) {
+        TIMESERIES = openOutputFile(seriesFile, "wb", CHECKPOINT_TIMESERIES);
+        if(TIMESERIES == NULL) {
+            fprintf(stderr,"ERROR: failed to open file: \"%s\"\n",
+                seriesFile);
+            return 1;
+        }
+        if(RESUME.lineNo == 0) {
+            writeSeriesHeader(TIMESERIES);
+        }
+    }
+    if(indexFile != NULL && !scaling) {
+        INDEX = openOutputFile(indexFile, "wb", CHECKPOINT_INDEX);
+        if(INDEX == NULL) {
+            fprintf(stderr,"ERROR: failed to open file: \"%s\"\n",
+                indexFile);
+            return 1;
+        }
+        if(RESUME.lineNo == 0) {
+            fputs(INDEX_MAGIC, INDEX);
+        }
+    }
+    if(scaling) {
+        runScaling(textfile);
+    }
+    else if(jobs > 1) {
+        PoolStats stats = {0};
+        playParallel(textfile, jobs, &stats);
+    }
+    else {
+        play(textfile);
+    }
+    // The run is complete, a new run starts from the beginning. A follow
+    // run that was stopped is continued from its last checkpoint instead.
+    if(CHECKPOINT_FILE != NULL && !FOLLOW) {
+        remove(CHECKPOINT_FILE);
+    }
+    if(STATS != NULL) {
+        writeStatsSummary(STATS);
+        fclose(STATS);
+    }
+    if(LATENCY != NULL) {
+        writeLatencyReport(LATENCY);
+        fclose(LATENCY);
+    }
+    if(TIMESERIES != NULL) {
+        flushSeriesChunk(TIMESERIES);
+        fclose(TIMESERIES);
+    }
+    if(INDEX != NULL) {
+        if(fclose(INDEX) != 0) {
+            fprintf(stderr, "ERROR: failed to write index: %s\n",
+                strerror(errno));
+            return 1;
+        }
+        sortIndex(indexFile);
+    }
+    if(CATALOG != NULL) {
+        freeCatalog(CATALOG);
+    }
+    if(BINARY_RESULTS != NULL && !closeBinaryOutput()) {
+        fprintf(stderr, "ERROR: failed to write binary output: %s\n",
+            strerror(errno));
+        return 1;
+    }
+    if(OUTPUT != stdout && fclose(OUTPUT) != 0) {
+        fprintf(stderr, "ERROR: failed to write output: %s\n",
+            strerror(errno));
+        return 1;
+    }
+    if(PERF_REPORT != NULL) {
+        writePerfReport(PERF_REPORT);
+        fclose(PERF_REPORT);
+    }
+    if(TRACE_FILE != NULL) {
+        writeTrace(TRACE_FILE);
+        fclose(TRACE_FILE);
+    }
+#ifdef HOT_COUNTERS
+    writeHotCounters(stderr);
+#endif
+    if(memoryFile != NULL && !writeMemoryFile(memoryFile)) {
+        return 1;
+    }
 }
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////